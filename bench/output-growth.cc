@@ -0,0 +1,239 @@
+/*
+ * Copyright 2010, Ivan Egorov (egorich.3.04@gmail.com).
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Counts output buffer reallocations done by ZipLib::Write()/Finish() loops
+// with linear growth (GrowBy(dataLength + 1), 128 bytes in Finish) and with
+// geometric growth driven by processor hints (Reserve()). As in ZipLib, each
+// write gets its own output buffer.
+//
+// Build and run:
+//   g++ -O2 -o output-growth bench/output-growth.cc -lz
+//   ./output-growth [megabytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "../src/utils.h"
+
+typedef ScopedOutputBuffer<Bytef> Blob;
+
+enum Policy {
+  Linear,
+  Geometric
+};
+
+struct Stats {
+  Stats()
+    : reallocs(0), copied(0), seconds(0)
+  {}
+
+  int reallocs;
+  size_t copied;
+  double seconds;
+};
+
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+// Append request output to the whole stream output.
+static void Collect(Blob &result, Blob &out) {
+  result.Reserve(out.length());
+  memcpy(result.data() + result.length(), out.data(), out.length());
+  result.IncreaseLengthBy(out.length());
+}
+
+
+// Grow output the way ZipLib does and count reallocations of already
+// allocated storage. Copied bytes are an upper bound, as realloc() may extend
+// block in place.
+static bool Grow(Blob &out, Policy policy, size_t linear, size_t hint,
+    Stats &stats) {
+  size_t capacity = out.capacity();
+  size_t length = out.length();
+  bool result = policy == Linear ? out.GrowBy(linear) : out.Reserve(hint);
+  if (capacity != 0 && out.capacity() != capacity) {
+    ++stats.reallocs;
+    stats.copied += length;
+  }
+  return result;
+}
+
+
+// Mirrors GzipImpl::Bound() for memLevel 8.
+static const size_t PendingLimit = 4 << (8 + 6);
+
+static size_t DeflateHint(z_stream &stream, uLong totalIn, size_t limit) {
+  uLong bound = deflateBound(&stream, totalIn);
+  if (bound <= stream.total_out || bound - stream.total_out > limit) {
+    return limit;
+  }
+  return bound - stream.total_out;
+}
+
+
+static Stats Deflate(const Bytef *data, size_t length, size_t chunk,
+    Policy policy, Blob &result) {
+  Stats stats;
+  double start = Now();
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+      Z_DEFAULT_STRATEGY);
+
+  for (size_t offset = 0; offset < length; offset += chunk) {
+    Blob out;
+    int dataLength = length - offset < chunk ? length - offset : chunk;
+    stream.next_in = const_cast<Bytef*>(data + offset);
+    stream.avail_in = dataLength;
+    while (stream.avail_in > 0) {
+      Grow(out, policy, stream.avail_in + 1,
+          DeflateHint(stream, stream.total_in + stream.avail_in,
+            deflateBound(&stream, stream.avail_in) + PendingLimit), stats);
+      stream.next_out = out.data() + out.length();
+      size_t initAvail = stream.avail_out = out.avail();
+      deflate(&stream, Z_NO_FLUSH);
+      out.IncreaseLengthBy(initAvail - stream.avail_out);
+    }
+    Collect(result, out);
+  }
+
+  Blob out;
+  int ret;
+  do {
+    Grow(out, policy, 128,
+        DeflateHint(stream, stream.total_in,
+          deflateBound(&stream, 0) + PendingLimit), stats);
+    stream.next_out = out.data() + out.length();
+    size_t initAvail = stream.avail_out = out.avail();
+    ret = deflate(&stream, Z_FINISH);
+    out.IncreaseLengthBy(initAvail - stream.avail_out);
+  } while (ret != Z_STREAM_END);
+  deflateEnd(&stream);
+  Collect(result, out);
+
+  stats.seconds = Now() - start;
+  return stats;
+}
+
+
+static Stats Inflate(const Bytef *data, size_t length, size_t chunk,
+    Policy policy, Blob &result) {
+  const size_t ExpectedRatio = 4;
+
+  Stats stats;
+  double start = Now();
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  inflateInit2(&stream, 16 + MAX_WBITS);
+
+  int ret = Z_OK;
+  for (size_t offset = 0; offset < length && ret != Z_STREAM_END;
+      offset += chunk) {
+    Blob out;
+    int dataLength = length - offset < chunk ? length - offset : chunk;
+    stream.next_in = const_cast<Bytef*>(data + offset);
+    stream.avail_in = dataLength;
+    while (stream.avail_in > 0 && ret != Z_STREAM_END) {
+      Grow(out, policy, stream.avail_in + 1,
+          stream.avail_in * ExpectedRatio + 1, stats);
+      stream.next_out = out.data() + out.length();
+      size_t initAvail = stream.avail_out = out.avail();
+      ret = inflate(&stream, Z_NO_FLUSH);
+      out.IncreaseLengthBy(initAvail - stream.avail_out);
+    }
+    Collect(result, out);
+  }
+  inflateEnd(&stream);
+
+  stats.seconds = Now() - start;
+  return stats;
+}
+
+
+static void Report(const char *name, const Stats &linear,
+    const Stats &geometric) {
+  printf("%-28s %10d %10d %12.1f %12.1f %8.3f %8.3f\n", name,
+      linear.reallocs, geometric.reallocs,
+      linear.copied / 1048576.0, geometric.copied / 1048576.0,
+      linear.seconds, geometric.seconds);
+}
+
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? atoi(argv[1]) : 32;
+  size_t length = megabytes << 20;
+
+  // Log-like text compresses roughly 5-10 times.
+  Bytef *data = (Bytef*) malloc(length);
+  srand(239);
+  for (size_t i = 0; i < length; ) {
+    i += snprintf(reinterpret_cast<char*>(data + i), length - i,
+        "%08d GET /api/v1/items/%d?page=%d HTTP/1.1 200 %d\n",
+        rand() % 100000000, rand() % 5000, rand() % 20, rand() % 65536);
+  }
+
+  printf("%zu MB of input\n", megabytes);
+  printf("%-28s %10s %10s %12s %12s %8s %8s\n", "",
+      "reallocs", "", "copied MB", "", "seconds", "");
+  printf("%-28s %10s %10s %12s %12s %8s %8s\n", "case",
+      "linear", "geometric", "linear", "geometric", "linear", "geometric");
+
+  const size_t chunks[] = { 64 << 10, 1 << 20, length };
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+    char name[64];
+
+    Blob compressed;
+    Stats linear = Deflate(data, length, chunks[i], Linear, compressed);
+    Blob unused;
+    Stats geometric = Deflate(data, length, chunks[i], Geometric, unused);
+    snprintf(name, sizeof(name), "deflate, %zu KB writes", chunks[i] >> 10);
+    Report(name, linear, geometric);
+
+    Blob a, b;
+    linear = Inflate(compressed.data(), compressed.length(), chunks[i],
+        Linear, a);
+    geometric = Inflate(compressed.data(), compressed.length(), chunks[i],
+        Geometric, b);
+    snprintf(name, sizeof(name), "inflate, %zu KB writes", chunks[i] >> 10);
+    Report(name, linear, geometric);
+
+    if (a.length() != length || b.length() != length ||
+        memcmp(a.data(), data, length) != 0 ||
+        memcmp(b.data(), data, length) != 0) {
+      fprintf(stderr, "Round trip failed\n");
+      return 1;
+    }
+  }
+
+  free(data);
+  return 0;
+}
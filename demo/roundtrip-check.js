@@ -0,0 +1,725 @@
+/*
+ * Copyright 2010, Ivan Egorov (egorich.3.04@gmail.com).
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Round trip checks of compressors and decompressors. Output of each one is
+// compared with input, or with output of its serial counter-part. Exits with
+// exception on the first mismatch.
+//
+// Run from demo directory:
+//   node roundtrip-check.js
+
+var compress=require("../lib/compress");
+var sys=require("sys");
+var fs=require("fs");
+var assert=require("assert");
+var Buffer = require('buffer').Buffer;
+
+var TMP_PREFIX = '/tmp/node-compress-check-' + process.pid;
+var tmpFiles = [];
+
+
+// Deterministic input: log-like lines, mixed with runs and noise, so that
+// bzip2 blocks and deflate blocks vary in size and alignment.
+function makeData(length, seed) {
+  var buffer = new Buffer(length);
+  function random(n) {
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+    return seed % n;
+  }
+
+  var pos = 0;
+  while (pos < length) {
+    var kind = random(16);
+    var count = Math.min(length - pos, 20 + random(200));
+    for (var i = 0; i < count; ++i) {
+      if (kind == 0) {
+        buffer[pos + i] = random(256);
+      } else if (kind == 1) {
+        buffer[pos + i] = 0x61;
+      } else {
+        buffer[pos + i] = i == count - 1 ? 10 : 0x20 + random(16) * 4;
+      }
+    }
+    pos += count;
+  }
+  return buffer;
+}
+
+
+function concat(parts) {
+  var total = 0;
+  for (var i = 0; i < parts.length; ++i) {
+    total += parts[i].length;
+  }
+  var result = new Buffer(total);
+  var pos = 0;
+  for (var i = 0; i < parts.length; ++i) {
+    parts[i].copy(result, pos, 0, parts[i].length);
+    pos += parts[i].length;
+  }
+  return result;
+}
+
+
+function assertSame(actual, expected, what) {
+  assert.ok(actual.length == expected.length &&
+      actual.toString('binary') == expected.toString('binary'),
+      what + ': got ' + actual.length + ' bytes, expected ' +
+      expected.length);
+}
+
+
+// Pass input to (de)compressor in chunks, all queued at once, and collect
+// its output. callback(exc, buffer) is called once.
+function processAll(processor, input, chunk, callback) {
+  var parts = [];
+  var failed = false;
+  function collect(err, data) {
+    if (failed) {
+      return false;
+    }
+    if (err) {
+      failed = true;
+      callback(err);
+      return false;
+    }
+    if (data.length != 0) {
+      parts.push(data);
+    }
+    return true;
+  }
+
+  processor.setBufferOutput(true);
+  for (var pos = 0; pos < input.length; pos += chunk) {
+    processor.write(input.slice(pos, Math.min(input.length, pos + chunk)),
+        collect);
+  }
+  processor.close(function(err, data) {
+    if (collect(err, data)) {
+      callback(null, concat(parts));
+    }
+  });
+}
+
+
+function writeTmp(suffix, data) {
+  var path = TMP_PREFIX + '-' + tmpFiles.length + suffix;
+  fs.writeFileSync(path, data);
+  tmpFiles.push(path);
+  return path;
+}
+
+
+// Read ranges one after another by read(offset, length, callback) and
+// compare them with data.
+function checkRanges(read, data, ranges, callback) {
+  var i = 0;
+  function step() {
+    if (i == ranges.length) {
+      callback(null);
+      return;
+    }
+    var offset = ranges[i][0];
+    var length = ranges[i][1];
+    ++i;
+    read(offset, length, function(err, buffer) {
+      if (err) {
+        callback(err);
+        return;
+      }
+      var end = Math.min(data.length, offset + length);
+      assertSame(buffer, data.slice(Math.min(offset, end), end),
+          'range at ' + offset);
+      step();
+    });
+  }
+  step();
+}
+
+
+function someRanges(length, span) {
+  return [[0, 100], [1, span], [span - 1, 2], [span, span * 2 + 3],
+          [Math.floor(length / 2), 12345], [length - 10, 100],
+          [length - span - 1, span + 1], [length + 10, 10]];
+}
+
+
+// Decompress input by indexing decompressor, adding points it reports to
+// index. callback(exc) is called after output is checked.
+function buildIndex(index, decompressor, input, expected, callback) {
+  decompressor.onaccesspoint = function(input, output, window) {
+    index.add(input, output, window);
+  };
+  processAll(decompressor, input, 65536, function(err, output) {
+    assert.ifError(err);
+    assertSame(output, expected, 'indexing decompressor');
+    assert.ok(index.length() > 3, 'points are reported');
+    callback(null);
+  });
+}
+
+
+var data = makeData(3 << 20, 239);
+var small = makeData(50000, 17);
+var checks = [];
+
+function check(name, fun) {
+  checks.push({ name: name, fun: fun });
+}
+
+
+check('ParallelGzip output is read by Gunzip', function(done) {
+  var z = compress.ParallelGzip.compressSync(data, 6,
+      { blockSize: 100000, threads: 3 });
+  assertSame(compress.Gunzip.decompressSync(z), data, 'compressSync');
+  processAll(new compress.ParallelGzip(6, { blockSize: 1024, threads: 2 }),
+      small, 777, function(err, z) {
+    assert.ifError(err);
+    assertSame(compress.Gunzip.decompressSync(z), small, 'small blocks');
+    done(null);
+  });
+});
+
+
+check('ParallelBzip output is read by Bunzip', function(done) {
+  var z = compress.ParallelBzip.compressSync(data, 1, 0, { threads: 3 });
+  assertSame(compress.Bunzip.decompressSync(z), data, 'compressSync');
+  var bzip = new compress.ParallelBzip(1, 0, { threads: 2 });
+  processAll(bzip, small, 999, function(err, z) {
+    assert.ifError(err);
+    assertSame(compress.Bunzip.decompressSync(z), small, 'streamed');
+    done(null);
+  });
+});
+
+
+// Streams of different block sizes and an empty one, as bzip2 files
+// concatenated by cat. Chunks cut block magics at different alignments.
+check('ParallelBunzip matches Bunzip on concatenated streams',
+    function(done) {
+  var z = concat([compress.Bzip.compressSync(data, 1, 0),
+                  compress.Bzip.compressSync(new Buffer(0), 9, 0),
+                  compress.Bzip.compressSync(small, 9, 0),
+                  compress.ParallelBzip.compressSync(data, 2, 0)]);
+  var expected = compress.Bunzip.decompressSync(z);
+  assertSame(expected, concat([data, small, data]), 'Bunzip');
+  assertSame(compress.ParallelBunzip.decompressSync(z, false, { threads: 3 }),
+      expected, 'decompressSync');
+
+  var chunks = [1, 4093, 1 << 20];
+  var i = 0;
+  function step() {
+    if (i == chunks.length) {
+      done(null);
+      return;
+    }
+    var chunk = chunks[i++];
+    var input = chunk == 1 ? compress.Bzip.compressSync(small, 1, 0) : z;
+    var output = chunk == 1 ? small : expected;
+    processAll(new compress.ParallelBunzip(false, { threads: 3 }), input,
+        chunk, function(err, result) {
+      assert.ifError(err);
+      assertSame(result, output, 'chunks of ' + chunk);
+      step();
+    });
+  }
+  step();
+});
+
+
+// Stream CRC is checked over blocks decoded on different threads.
+check('ParallelBunzip reports corrupted and truncated input',
+    function(done) {
+  var z = compress.ParallelBzip.compressSync(data, 1, 0);
+  var corrupted = new Buffer(z.length);
+  z.copy(corrupted, 0, 0, z.length);
+  corrupted[Math.floor(z.length / 2)] ^= 0x10;
+  var inputs = [corrupted, z.slice(0, z.length - 100),
+                z.slice(0, Math.floor(z.length / 3)),
+                concat([z, new Buffer('BZh9')])];
+  for (var i = 0; i < inputs.length; ++i) {
+    assert.throws(function() {
+      compress.Bunzip.decompressSync(inputs[i]);
+    }, Error);
+    assert.throws(function() {
+      compress.ParallelBunzip.decompressSync(inputs[i]);
+    }, Error);
+  }
+  done(null);
+});
+
+
+// Padding and garbage following the last stream are ignored, even if they
+// are longer than any block.
+check('ParallelBunzip ignores data following the last stream',
+    function(done) {
+  var z = compress.Bzip.compressSync(small, 9, 0);
+  var zeros = new Buffer(1000);
+  for (var i = 0; i < zeros.length; ++i) {
+    zeros[i] = 0;
+  }
+  var noise = makeData(5 << 20, 31);
+  noise[0] = 10;
+  var tails = [new Buffer('\n'), zeros, noise];
+  for (var i = 0; i < tails.length; ++i) {
+    var input = concat([z, tails[i]]);
+    assertSame(compress.Bunzip.decompressSync(input), small,
+        'Bunzip, tail ' + i);
+    assertSame(compress.ParallelBunzip.decompressSync(input), small,
+        'ParallelBunzip, tail ' + i);
+  }
+  processAll(new compress.ParallelBunzip(), concat([z, noise]), 4096,
+      function(err, output) {
+    assert.ifError(err);
+    assertSame(output, small, 'chunks');
+    done(null);
+  });
+});
+
+
+check('ParallelGunzip matches Gunzip on multi-member input', function(done) {
+  var z = concat([compress.Gzip.compressSync(small),
+                  compress.Bgzf.compressSync(data, 6, { threads: 3 }),
+                  compress.ParallelGzip.compressSync(small, 6),
+                  compress.Bgzf.compressSync(small)]);
+  var expected = compress.Gunzip.decompressSync(z);
+  assertSame(expected, concat([small, data, small, small]), 'Gunzip');
+  assertSame(compress.ParallelGunzip.decompressSync(z, { threads: 3 }),
+      expected, 'decompressSync');
+  processAll(new compress.ParallelGunzip({ threads: 2 }), z, 65537,
+      function(err, output) {
+    assert.ifError(err);
+    assertSame(output, expected, 'ParallelGunzip');
+    done(null);
+  });
+});
+
+
+// Trailing data is ignored whatever its first byte, even the first byte of
+// gzip magic, while a member cut short is reported.
+check('Gunzip and ParallelGunzip ignore data following the last member',
+    function(done) {
+  var z = compress.Bgzf.compressSync(small);
+  var tails = ['\n', '\x1f', '\x1f\x00', '\x1fgarbage', 'x\x1f\x8b'];
+  var ctors = [compress.Gunzip, compress.ParallelGunzip];
+  for (var i = 0; i < tails.length; ++i) {
+    var input = concat([z, new Buffer(tails[i], 'binary')]);
+    for (var j = 0; j < ctors.length; ++j) {
+      assertSame(ctors[j].decompressSync(input), small,
+          'decompressor ' + j + ', tail ' + i);
+    }
+  }
+  var cut = concat([z, new Buffer('\x1f\x8b\x08', 'binary')]);
+  for (var j = 0; j < ctors.length; ++j) {
+    assert.throws(function() {
+      ctors[j].decompressSync(cut);
+    }, Error);
+  }
+
+  // The first byte of magic comes alone.
+  var gunzip = new compress.Gunzip();
+  processAll(gunzip, concat([z, new Buffer('\x1fx', 'binary')]), 1,
+      function(err, output) {
+    assert.ifError(err);
+    assertSame(output, small, 'byte by byte');
+    done(null);
+  });
+});
+
+
+check('BgzfReader reads Bgzf blocks at virtual offsets', function(done) {
+  var blocks = [{ input: 0, output: 0 }];
+  var bgzf = new compress.Bgzf(6, { threads: 3 });
+  bgzf.onmember = function(input, output) {
+    blocks.push({ input: input, output: output });
+  };
+  processAll(bgzf, data, 100000, function(err, z) {
+    assert.ifError(err);
+    assertSame(compress.Gunzip.decompressSync(z), data, 'Gunzip');
+    assert.ok(blocks.length > data.length / 65280, 'blocks are reported');
+
+    var fd = fs.openSync(writeTmp('.bgz', z), 'r');
+    var reader = new compress.BgzfReader(fd);
+    var i = 0;
+    function step() {
+      if (i + 1 >= blocks.length) {
+        fs.closeSync(fd);
+        done(null);
+        return;
+      }
+      var block = blocks[i];
+      var skip = i % 2 ? 0 : 1000;
+      var length = 70000;
+      var offset = compress.BgzfReader.virtualOffset(block.output, skip);
+      i += 7;
+      reader.read(offset, length, function(err, buffer) {
+        assert.ifError(err);
+        var start = block.input + skip;
+        assertSame(buffer,
+            data.slice(start, Math.min(data.length, start + length)),
+            'block at ' + block.output);
+        step();
+      });
+    }
+    step();
+  });
+});
+
+
+check('GzipIndex reads gzip file at offsets', function(done) {
+  var z = concat([compress.Gzip.compressSync(data),
+                  compress.Gzip.compressSync(small)]);
+  var expected = concat([data, small]);
+  var span = 1 << 18;
+  var index = new compress.GzipIndex();
+  var gunzip = new compress.Gunzip({ indexSpan: span });
+  buildIndex(index, gunzip, z, expected, function() {
+    var fd = fs.openSync(writeTmp('.gz', z), 'r');
+    function read(offset, length, callback) {
+      index.read(fd, offset, length, callback);
+    }
+    checkRanges(read, expected, someRanges(expected.length, span),
+        function(err) {
+      assert.ifError(err);
+      fs.closeSync(fd);
+      done(null);
+    });
+  });
+});
+
+
+// Loaded index finds the same points and reads the same ranges, and index
+// file with entry count exceeding its size is rejected before reading.
+check('GzipIndex reads the same after save and load', function(done) {
+  var z = compress.Gzip.compressSync(data);
+  var span = 1 << 17;
+  var index = new compress.GzipIndex();
+  var gunzip = new compress.Gunzip({ indexSpan: span });
+  buildIndex(index, gunzip, z, data, function() {
+    var path = writeTmp('.gzix', '');
+    index.save(path, function(err) {
+      assert.ifError(err);
+      compress.GzipIndex.load(path, function(err, loaded) {
+        assert.ifError(err);
+        assert.equal(loaded.length(), index.length());
+        assert.equal(loaded.points.length, 0);
+        var offsets = [0, span, Math.floor(data.length / 3), data.length];
+        for (var i = 0; i < offsets.length; ++i) {
+          var point = index.find(offsets[i]);
+          var found = loaded.find(offsets[i]);
+          assert.equal(found === null, point === null);
+          assert.ok(found === null || (found.input == point.input &&
+                found.output == point.output), 'point at ' + offsets[i]);
+        }
+
+        var fd = fs.openSync(writeTmp('.gz', z), 'r');
+        function read(offset, length, callback) {
+          loaded.read(fd, offset, length, callback);
+        }
+        checkRanges(read, data, someRanges(data.length, span),
+            function(err) {
+          assert.ifError(err);
+          loaded.close();
+          fs.closeSync(fd);
+
+          var header = fs.readFileSync(path).slice(0, 16);
+          header[11] = 0x7f;
+          compress.GzipIndex.load(writeTmp('.bad.gzix', header),
+              function(err, index) {
+            assert.ok(err, 'huge entry count is reported');
+            done(null);
+          });
+        });
+      });
+    });
+  });
+});
+
+
+check('BzipIndex reads bzip2 file at offsets', function(done) {
+  var z = compress.ParallelBzip.compressSync(data, 1, 0);
+  var index = new compress.BzipIndex();
+  var bunzip = new compress.ParallelBunzip(false, { index: true });
+  buildIndex(index, bunzip, z, data, function() {
+    var fd = fs.openSync(writeTmp('.bz2', z), 'r');
+    var ranges = someRanges(data.length, 100000);
+    var path = writeTmp('.bzix', '');
+    function read(offset, length, callback) {
+      index.read(fd, offset, length, callback);
+    }
+    checkRanges(read, data, ranges, function(err) {
+      assert.ifError(err);
+      index.save(path, function(err) {
+        assert.ifError(err);
+        compress.BzipIndex.load(path, function(err, loaded) {
+          assert.ifError(err);
+          index = loaded;
+          checkRanges(read, data, ranges, function(err) {
+            assert.ifError(err);
+            loaded.close();
+            fs.closeSync(fd);
+            done(null);
+          });
+        });
+      });
+    });
+  });
+});
+
+
+// File is cut inside a middle block, and the range ends with that block,
+// so that decompression stops before the end of file.
+check('BzipIndex reports truncated file', function(done) {
+  var z = compress.ParallelBzip.compressSync(data, 1, 0);
+  var index = new compress.BzipIndex();
+  var bunzip = new compress.ParallelBunzip(false, { index: true });
+  buildIndex(index, bunzip, z, data, function() {
+    var k = Math.floor(index.length() / 2);
+    var point = index.points[k];
+    var next = index.points[k + 1];
+    var cut = Math.floor((point.input + next.input) / 16);
+    var fd = fs.openSync(writeTmp('.bz2', z.slice(0, cut)), 'r');
+    index.read(fd, point.output, next.output - point.output,
+        function(err, buffer) {
+      fs.closeSync(fd);
+      assert.ok(err, 'truncated block is reported');
+      done(null);
+    });
+  });
+});
+
+
+// Small messages share most of their strings, which a dictionary holds.
+function makeMessages(count) {
+  var messages = [];
+  for (var i = 0; i < count; ++i) {
+    messages.push(new Buffer('{"type":"event","user":"user' + i * 7919 +
+        '","action":"' + (i % 3 ? 'click' : 'view') + '","page":"/items/' +
+        i + '","agent":"Mozilla/5.0 (X11; Linux x86_64)"}'));
+  }
+  return messages;
+}
+
+
+check('Dictionary round trip of zlib and raw deflate', function(done) {
+  var messages = makeMessages(50);
+  var dictionary = new compress.Dictionary(concat(messages.slice(0, 10)));
+  var other = new compress.Dictionary(new Buffer('something else'));
+  var options = { dictionary: dictionary };
+  var plain = 0;
+  var trained = 0;
+  for (var i = 10; i < messages.length; ++i) {
+    var message = messages[i];
+    var z = compress.Deflate.compressSync(message, 9, options);
+    assertSame(compress.Inflate.decompressSync(z, options), message,
+        'Inflate ' + i);
+    assert.throws(function() {
+      compress.Inflate.decompressSync(z);
+    }, Error);
+    assert.throws(function() {
+      compress.Inflate.decompressSync(z, { dictionary: other });
+    }, Error);
+    var raw = compress.DeflateRaw.compressSync(message, 9, options);
+    assertSame(compress.InflateRaw.decompressSync(raw, options), message,
+        'InflateRaw ' + i);
+    plain += compress.Deflate.compressSync(message, 9).length;
+    trained += z.length;
+  }
+  assert.ok(trained < plain, 'dictionary makes messages smaller');
+
+  var stream = concat(messages);
+  processAll(new compress.Deflate(6, options), stream, 100,
+      function(err, z) {
+    assert.ifError(err);
+    processAll(new compress.Inflate(options), z, 7, function(err, output) {
+      assert.ifError(err);
+      assertSame(output, stream, 'chunks');
+      done(null);
+    });
+  });
+});
+
+
+check('trainDictionary builds dictionary from samples', function(done) {
+  var messages = makeMessages(200);
+  assert.throws(function() {
+    compress.trainDictionary([messages[0], 'not a buffer'], 1024,
+        function() {});
+  }, TypeError);
+  assert.throws(function() {
+    compress.trainDictionary(messages, 0, function() {});
+  }, TypeError);
+  assert.throws(function() {
+    compress.trainDictionary(messages, 1 << 20, function() {});
+  }, TypeError);
+
+  compress.trainDictionary(messages.slice(0, 100), 2048,
+      function(err, dictionary, stats) {
+    assert.ifError(err);
+    assert.ok(dictionary.length > 0 && dictionary.length <= 2048,
+        'dictionary size');
+    assert.ok(stats.gain > 1 && stats.trainedLength < stats.plainLength,
+        'dictionary makes samples smaller');
+
+    var options = { dictionary: dictionary };
+    for (var i = 100; i < messages.length; ++i) {
+      var z = compress.Deflate.compressSync(messages[i], 9, options);
+      assertSame(compress.Inflate.decompressSync(z, options), messages[i],
+          'message ' + i);
+    }
+    done(null);
+  });
+});
+
+
+check('Deflate and DeflateRaw round trip', function(done) {
+  var pairs = [[compress.Deflate, compress.Inflate],
+               [compress.DeflateRaw, compress.InflateRaw],
+               [compress.Gzip, compress.Gunzip]];
+  var outputs = [];
+  for (var i = 0; i < pairs.length; ++i) {
+    var z = pairs[i][0].compressSync(small, 6);
+    outputs.push(z);
+    assertSame(pairs[i][1].decompressSync(z), small, 'pair ' + i);
+    // Single member formats ignore whatever follows them.
+    if (i < 2) {
+      assertSame(pairs[i][1].decompressSync(concat([z, z])), small,
+          'trailing data, pair ' + i);
+    }
+  }
+  // Formats differ by header and trailer only.
+  assert.throws(function() {
+    compress.Gunzip.decompressSync(outputs[0]);
+  }, Error);
+  assert.throws(function() {
+    compress.Inflate.decompressSync(outputs[1]);
+  }, Error);
+  assert.throws(function() {
+    compress.Inflate.decompressSync(outputs[2]);
+  }, Error);
+  assert.ok(outputs[1].length < outputs[0].length &&
+      outputs[0].length < outputs[2].length, 'header sizes');
+  assert.throws(function() {
+    new compress.Gzip(6, { dictionary: new compress.Dictionary(small) });
+  }, TypeError);
+
+  processAll(new compress.DeflateRaw(6), data, 65536, function(err, z) {
+    assert.ifError(err);
+    processAll(new compress.InflateRaw(), z, 1000, function(err, output) {
+      assert.ifError(err);
+      assertSame(output, data, 'chunks');
+      done(null);
+    });
+  });
+});
+
+
+// Format is told by the first bytes, so inputs shorter than those are
+// checked too.
+check('AutoDecompress reads every format', function(done) {
+  var dictionary = new compress.Dictionary(small.slice(0, 4096));
+  var inputs = [small, small.slice(0, 1), new Buffer(0)];
+  for (var i = 0; i < inputs.length; ++i) {
+    var input = inputs[i];
+    var outputs = [compress.Gzip.compressSync(input),
+                   compress.Deflate.compressSync(input),
+                   compress.DeflateRaw.compressSync(input),
+                   compress.Bgzf.compressSync(input),
+                   compress.Bzip.compressSync(input),
+                   compress.Deflate.compressSync(input, 6,
+                       { dictionary: dictionary })];
+    for (var j = 0; j < outputs.length; ++j) {
+      assertSame(compress.AutoDecompress.decompressSync(outputs[j],
+            { dictionary: dictionary }), input,
+          'input ' + i + ', format ' + j);
+    }
+  }
+  assert.throws(function() {
+    new compress.AutoDecompress({ dictionary: 'not a dictionary' });
+  }, TypeError);
+
+  var z = concat([compress.Gzip.compressSync(small),
+                  compress.Bgzf.compressSync(small)]);
+  processAll(new compress.AutoDecompress(), z, 1, function(err, output) {
+    assert.ifError(err);
+    assertSame(output, concat([small, small]), 'byte by byte');
+    done(null);
+  });
+});
+
+
+check('Deflate tuning options are checked and round trip', function(done) {
+  var bad = [{ windowBits: 8 }, { windowBits: 16 }, { windowBits: 'x' },
+             { memLevel: 0 }, { memLevel: 10 }, { strategy: 'fastest' }];
+  var ctors = [compress.Gzip, compress.Deflate, compress.DeflateRaw];
+  for (var i = 0; i < bad.length; ++i) {
+    for (var j = 0; j < ctors.length; ++j) {
+      assert.throws(function() {
+        new ctors[j](6, bad[i]);
+      }, TypeError);
+    }
+  }
+
+  var good = [{ windowBits: 9 }, { windowBits: 12, memLevel: 1 },
+              { memLevel: 9 }, { strategy: 'default' },
+              { strategy: 'filtered' }, { strategy: 'huffman' },
+              { strategy: 'rle' }, { strategy: 'fixed' }];
+  var pairs = [[compress.Gzip, compress.Gunzip],
+               [compress.Deflate, compress.Inflate],
+               [compress.DeflateRaw, compress.InflateRaw]];
+  var lengths = {};
+  for (var i = 0; i < good.length; ++i) {
+    for (var j = 0; j < pairs.length; ++j) {
+      var z = pairs[j][0].compressSync(small, 6, good[i]);
+      assertSame(pairs[j][1].decompressSync(z), small,
+          'options ' + i + ', pair ' + j);
+      lengths[i] = z.length;
+    }
+  }
+  // Huffman coding alone finds no matches in text.
+  assert.ok(lengths[5] > lengths[3], 'huffman is worse than default');
+
+  processAll(new compress.Gzip(9, { windowBits: 10, memLevel: 2 }), data,
+      65536, function(err, z) {
+    assert.ifError(err);
+    assertSame(compress.Gunzip.decompressSync(z), data, 'chunks');
+    done(null);
+  });
+});
+
+
+function run(i) {
+  if (i == checks.length) {
+    for (var j = 0; j < tmpFiles.length; ++j) {
+      fs.unlinkSync(tmpFiles[j]);
+    }
+    sys.puts('All ' + checks.length + ' checks passed.');
+    return;
+  }
+  checks[i].fun(function(err) {
+    assert.ifError(err);
+    sys.puts('ok ' + (i + 1) + ' - ' + checks[i].name);
+    run(i + 1);
+  });
+}
+
+run(0);
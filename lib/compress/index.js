@@ -21,6 +21,7 @@
  */
 
 var events = require('events');
+var fs = require('fs');
 var Buffer = require('buffer').Buffer;
 var assert = require('assert');
 var bindings = require('./compress-bindings');
@@ -39,6 +40,12 @@ function fallbackConstructor(str) {
 }
 
 
+function syncMethod(ctor) {
+  // Fallback constructor throws proper error, if library lacks support.
+  return ctor.processSync_ || ctor;
+}
+
+
 function inherits(ctor, superCtor) {
   ctor.prototype = Object.create(superCtor.prototype, {
       constructor: {
@@ -54,6 +61,7 @@ var Gzip = bindings.Gzip ||
 Gzip.prototype.init = removed('Use constructor to create new gzip object.');
 Gzip.prototype.deflate = removed('Use write() instead.');
 Gzip.prototype.end = removed('Use close() instead.');
+Gzip.compressSync = syncMethod(Gzip);
 
 
 var Gunzip = bindings.Gunzip ||
@@ -61,6 +69,53 @@ var Gunzip = bindings.Gunzip ||
 Gunzip.prototype.init = removed('Use constructor to create new gunzip object.');
 Gunzip.prototype.inflate = removed('Use write() instead.');
 Gunzip.prototype.end = removed('Use close() instead.')
+Gunzip.decompressSync = syncMethod(Gunzip);
+
+
+var Deflate = bindings.Deflate ||
+    fallbackConstructor('Library built without gzip support.');
+Deflate.compressSync = syncMethod(Deflate);
+
+
+var Inflate = bindings.Inflate ||
+    fallbackConstructor('Library built without gzip support.');
+Inflate.decompressSync = syncMethod(Inflate);
+
+
+var DeflateRaw = bindings.DeflateRaw ||
+    fallbackConstructor('Library built without gzip support.');
+DeflateRaw.compressSync = syncMethod(DeflateRaw);
+
+
+var InflateRaw = bindings.InflateRaw ||
+    fallbackConstructor('Library built without gzip support.');
+InflateRaw.decompressSync = syncMethod(InflateRaw);
+
+
+var AutoDecompress = bindings.AutoDecompress ||
+    fallbackConstructor('Library built without gzip support.');
+AutoDecompress.decompressSync = syncMethod(AutoDecompress);
+
+
+var Dictionary = bindings.Dictionary ||
+    fallbackConstructor('Library built without gzip support.');
+var trainDictionary = bindings.trainDictionary ||
+    fallbackConstructor('Library built without gzip support.');
+
+
+var ParallelGzip = bindings.ParallelGzip ||
+    fallbackConstructor('Library built without gzip support.');
+ParallelGzip.compressSync = syncMethod(ParallelGzip);
+
+
+var ParallelGunzip = bindings.ParallelGunzip ||
+    fallbackConstructor('Library built without gzip support.');
+ParallelGunzip.decompressSync = syncMethod(ParallelGunzip);
+
+
+var Bgzf = bindings.Bgzf ||
+    fallbackConstructor('Library built without gzip support.');
+Bgzf.compressSync = syncMethod(Bgzf);
 
 
 var Bzip = bindings.Bzip ||
@@ -68,6 +123,12 @@ var Bzip = bindings.Bzip ||
 Bzip.prototype.init = removed('Use constructor to create new bzip object.');
 Bzip.prototype.deflate = removed('Use write() instead.');
 Bzip.prototype.end = removed('Use close() instead.');
+Bzip.compressSync = syncMethod(Bzip);
+
+
+var ParallelBzip = bindings.ParallelBzip ||
+    fallbackConstructor('Library built without bzip support.');
+ParallelBzip.compressSync = syncMethod(ParallelBzip);
 
 
 var Bunzip = bindings.Bunzip ||
@@ -75,6 +136,12 @@ var Bunzip = bindings.Bunzip ||
 Bunzip.prototype.init = removed('Use constructor to create new bunzip object.');
 Bunzip.prototype.inflate = removed('Use write() instead.');
 Bunzip.prototype.end = removed('Use close() instead.')
+Bunzip.decompressSync = syncMethod(Bunzip);
+
+
+var ParallelBunzip = bindings.ParallelBunzip ||
+    fallbackConstructor('Library built without bzip support.');
+ParallelBunzip.decompressSync = syncMethod(ParallelBunzip);
 
 
 var apiWarnings = true;
@@ -90,20 +157,46 @@ function apiWarning(str) {
 };
 
 
+// === StreamEvent ===
+// Event reported by (de)compressor, e.g. end of member of multi-member
+// input, queued along with output data.
+function StreamEvent(name, args) {
+  this.name = name;
+  this.args = args;
+}
+
+
 // === CommonStream ===
 // Common base for compress/decompress streams.
 function CommonStream(ctor, args) {
   events.EventEmitter.call(this);
 
   this.dataQueue_ = [];
+  this.events_ = [];
   this.paused_ = false;
   this.inputEncoding_ = null;
   this.outputEncoding_ = null;
   this.readable = true;
   this.writeable = true;
 
+  // Writes passed to impl_, and those completed.
+  this.writes_ = 0;
+  this.writesDone_ = 0;
+
   this.impl_ = ctor.createInstance_.apply(
       null, Array.prototype.slice.call(args, 0));
+  this.impl_.setBufferOutput(true);
+
+  // Called just before callback with output containing member end or
+  // access point.
+  var self = this;
+  this.impl_.onmember = function(input, output) {
+    self.events_.push(new StreamEvent('member', [input, output]));
+  };
+  this.impl_.onaccesspoint = function(input, output, window) {
+    self.events_.push(
+        new StreamEvent('accesspoint', [input, output, window]));
+  };
 }
 inherits(CommonStream, events.EventEmitter);
 
@@ -151,8 +244,10 @@ CommonStream.prototype.write = function(data, opt_encoding) {
   }
 
   if (Buffer.isBuffer(buffer)) {
+    ++this.writes_;
     this.impl_.write(buffer, function(err, data) {
-      self.emitEvent_(err, data);
+      ++self.writesDone_;
+      self.writeDone_(err, data);
     });
   } else {
     process.nextTick(function() {
@@ -163,6 +258,27 @@ CommonStream.prototype.write = function(data, opt_encoding) {
 };
 
 
+CommonStream.prototype.writeDone_ = function(err, data) {
+  this.emitEvent_(err, data);
+};
+
+
+CommonStream.prototype.flush = function(opt_mode, opt_callback) {
+  var self = this;
+  if (typeof opt_mode === 'function') {
+    opt_callback = opt_mode;
+    opt_mode = undefined;
+  }
+
+  this.impl_.flush(opt_mode, function(err, data) {
+    self.emitEvent_(err, data);
+    if (opt_callback) {
+      opt_callback(err);
+    }
+  });
+};
+
+
 CommonStream.prototype.end = function() {
   this.writeable = false;
   this.close();
@@ -190,7 +306,9 @@ CommonStream.prototype.emitData_ = function() {
   if (!this.paused_) {
     for (var i = 0; i < this.dataQueue_.length; ++i) {
       var data = this.dataQueue_[i];
-      if (data !== null) {
+      if (data instanceof StreamEvent) {
+        this.emit.apply(this, [data.name].concat(data.args));
+      } else if (data !== null) {
         this.emit('data', data);
       } else {
         this.readable = false;
@@ -210,20 +328,13 @@ CommonStream.prototype.emitEvent_ = function(err, data, fin) {
   }
 
   if (data.length != 0) {
-    if (this.outputEncoding_ != 'binary') {
-      var str = data;
-      var len = Buffer.byteLength(str, 'binary');
-      data = new Buffer(len);
-      if (len > 0) {
-        data.write(str, 'binary', 0); 
-      }
-
-      if (this.outputEncoding_ != null) {
-        data = data.toString(this.outputEncoding_, 0, data.length);
-      }
+    if (this.outputEncoding_ != null) {
+      data = data.toString(this.outputEncoding_, 0, data.length);
     }
     this.dataQueue_.push(data);
   }
+  this.dataQueue_.push.apply(this.dataQueue_, this.events_);
+  this.events_.length = 0;
 
   if (fin) {
     this.dataQueue_.push(null);
@@ -236,10 +347,98 @@ CommonStream.prototype.emitEvent_ = function(err, data, fin) {
 // Common base for compression streams.
 function CompressStream(ctor, args) {
   CommonStream.call(this, ctor, args);
+  this.flushPolicy_ = null;
+  this.flushTimer_ = null;
+
+  // Writes known to be flushed, either by flush() or by native side.
+  this.flushedWrites_ = 0;
+  this.autoFlushed_ = false;
+
+  // Called just before callback of the last write flushed by policy.
+  var self = this;
+  this.impl_.onautoflush = function() {
+    self.autoFlushed_ = true;
+  };
 }
 inherits(CompressStream, CommonStream);
 
 
+// Flush output automatically: policy.interval milliseconds after first
+// unflushed write, or once policy.bytes of input are written since last
+// flush. Native side checks both on each write, timer covers idle stream.
+CompressStream.prototype.setFlushPolicy = function(policy) {
+  policy = policy || {};
+  this.impl_.setFlushPolicy(policy.interval || 0, policy.bytes || 0,
+      policy.mode);
+  this.flushPolicy_ = policy.interval ? policy : null;
+  this.clearFlushTimer_();
+};
+
+
+CompressStream.prototype.write = function(data, opt_encoding) {
+  var result = CommonStream.prototype.write.call(this, data, opt_encoding);
+  this.setFlushTimer_();
+  return result;
+};
+
+
+// Native side has flushed writes up to this one, so timer is restarted for
+// the writes following it, if any.
+CompressStream.prototype.writeDone_ = function(err, data) {
+  if (this.autoFlushed_) {
+    this.autoFlushed_ = false;
+    this.flushedWrites_ = Math.max(this.flushedWrites_, this.writesDone_);
+    this.clearFlushTimer_();
+    this.setFlushTimer_();
+  }
+  CommonStream.prototype.writeDone_.call(this, err, data);
+};
+
+
+CompressStream.prototype.flush = function(opt_mode, opt_callback) {
+  this.clearFlushTimer_();
+  this.flushedWrites_ = this.writes_;
+  CommonStream.prototype.flush.call(this, opt_mode, opt_callback);
+};
+
+
+CompressStream.prototype.close = function() {
+  this.clearFlushTimer_();
+  CommonStream.prototype.close.call(this);
+};
+
+
+CompressStream.prototype.destroy = function() {
+  this.clearFlushTimer_();
+  CommonStream.prototype.destroy.call(this);
+};
+
+
+// Flush unflushed writes once policy interval passes, unless native side
+// flushes them first.
+CompressStream.prototype.setFlushTimer_ = function() {
+  var policy = this.flushPolicy_;
+  if (policy !== null && this.writeable && this.flushTimer_ === null &&
+      this.flushedWrites_ < this.writes_) {
+    var self = this;
+    this.flushTimer_ = setTimeout(function() {
+      self.flushTimer_ = null;
+      if (self.flushedWrites_ < self.writes_) {
+        self.flush(policy.mode);
+      }
+    }, policy.interval);
+  }
+};
+
+
+CompressStream.prototype.clearFlushTimer_ = function() {
+  if (this.flushTimer_ !== null) {
+    clearTimeout(this.flushTimer_);
+    this.flushTimer_ = null;
+  }
+};
+
+
 CompressStream.prototype.setEncoding = function(enc) {
   assert.equal(enc, 'binary',
       'CompressStream emits either Buffer or binary string.');
@@ -274,6 +473,62 @@ function GunzipStream() {
 inherits(GunzipStream, DecompressStream);
 
 
+// === DeflateStream ===
+function DeflateStream() {
+  CompressStream.call(this, Deflate, arguments);
+}
+inherits(DeflateStream, CompressStream);
+
+
+// === InflateStream ===
+function InflateStream() {
+  DecompressStream.call(this, Inflate, arguments);
+}
+inherits(InflateStream, DecompressStream);
+
+
+// === DeflateRawStream ===
+function DeflateRawStream() {
+  CompressStream.call(this, DeflateRaw, arguments);
+}
+inherits(DeflateRawStream, CompressStream);
+
+
+// === InflateRawStream ===
+function InflateRawStream() {
+  DecompressStream.call(this, InflateRaw, arguments);
+}
+inherits(InflateRawStream, DecompressStream);
+
+
+// === AutoDecompressStream ===
+function AutoDecompressStream() {
+  DecompressStream.call(this, AutoDecompress, arguments);
+}
+inherits(AutoDecompressStream, DecompressStream);
+
+
+// === ParallelGzipStream ===
+function ParallelGzipStream() {
+  CompressStream.call(this, ParallelGzip, arguments);
+}
+inherits(ParallelGzipStream, CompressStream);
+
+
+// === ParallelGunzipStream ===
+function ParallelGunzipStream() {
+  DecompressStream.call(this, ParallelGunzip, arguments);
+}
+inherits(ParallelGunzipStream, DecompressStream);
+
+
+// === BgzfStream ===
+function BgzfStream() {
+  CompressStream.call(this, Bgzf, arguments);
+}
+inherits(BgzfStream, CompressStream);
+
+
 // === BzipStream ===
 function BzipStream() {
   CompressStream.call(this, Bzip, arguments);
@@ -281,6 +536,20 @@ function BzipStream() {
 inherits(BzipStream, CompressStream);
 
 
+// === ParallelBzipStream ===
+function ParallelBzipStream() {
+  CompressStream.call(this, ParallelBzip, arguments);
+}
+inherits(ParallelBzipStream, CompressStream);
+
+
+// === ParallelBunzipStream ===
+function ParallelBunzipStream() {
+  DecompressStream.call(this, ParallelBunzip, arguments);
+}
+inherits(ParallelBunzipStream, DecompressStream);
+
+
 // === BunzipStream ===
 function BunzipStream() {
   DecompressStream.call(this, Bunzip, arguments);
@@ -288,14 +557,707 @@ function BunzipStream() {
 inherits(BunzipStream, DecompressStream);
 
 
+function concatBuffers(parts, total) {
+  var result = new Buffer(total);
+  var offset = 0;
+  for (var i = 0; i < parts.length; ++i) {
+    parts[i].copy(result, offset, 0, parts[i].length);
+    offset += parts[i].length;
+  }
+  return result;
+}
+
+
+// === BgzfReader ===
+// Random access to BGZF file by virtual offsets. Virtual offset is offset
+// of block in file multiplied by 65536, plus offset within decompressed
+// block. Only blocks holding requested data are read and decompressed.
+var BGZF_BLOCK_SPAN = 65536;
+var BGZF_MAX_BLOCK_LENGTH = 65536;
+var BGZF_HEADER_LENGTH = 18;
+
+function BgzfReader(fd) {
+  this.fd_ = fd;
+
+  // The last block read, as blocks are usually read sequentially.
+  this.blockOffset_ = -1;
+  this.block_ = null;
+}
+
+
+BgzfReader.virtualOffset = function(blockOffset, inBlockOffset) {
+  return blockOffset * BGZF_BLOCK_SPAN + inBlockOffset;
+};
+
+
+// Read up to length bytes of decompressed data starting at virtualOffset.
+// callback(exc, buffer, nextVirtualOffset) gets less data only at the end
+// of file.
+BgzfReader.prototype.read = function(virtualOffset, length, callback) {
+  var self = this;
+  var blockOffset = Math.floor(virtualOffset / BGZF_BLOCK_SPAN);
+  var inBlockOffset = virtualOffset % BGZF_BLOCK_SPAN;
+  var parts = [];
+  var total = 0;
+
+  function done() {
+    callback(null, concatBuffers(parts, total),
+        BgzfReader.virtualOffset(blockOffset, inBlockOffset));
+  }
+
+  function step() {
+    self.readBlock_(blockOffset, function(err, block) {
+      if (err) {
+        callback(err);
+        return;
+      }
+      if (block === null) {
+        done();
+        return;
+      }
+      if (inBlockOffset > block.data.length) {
+        callback(new Error('Virtual offset is out of block'));
+        return;
+      }
+
+      var count = Math.min(length - total, block.data.length - inBlockOffset);
+      if (count > 0) {
+        parts.push(block.data.slice(inBlockOffset, inBlockOffset + count));
+        total += count;
+        inBlockOffset += count;
+      }
+      if (inBlockOffset == block.data.length) {
+        blockOffset = block.next;
+        inBlockOffset = 0;
+      }
+      if (total == length) {
+        done();
+      } else {
+        step();
+      }
+    });
+  }
+
+  step();
+};
+
+
+// Read and decompress block at offset. callback(exc, block) gets null
+// block at the end of file.
+BgzfReader.prototype.readBlock_ = function(offset, callback) {
+  if (offset === this.blockOffset_) {
+    callback(null, this.block_);
+    return;
+  }
+
+  var self = this;
+  var buffer = new Buffer(BGZF_MAX_BLOCK_LENGTH);
+  fs.read(this.fd_, buffer, 0, buffer.length, offset, function(err, read) {
+    if (err) {
+      callback(err);
+      return;
+    }
+    if (read == 0) {
+      callback(null, null);
+      return;
+    }
+    if (read < BGZF_HEADER_LENGTH || buffer[0] != 0x1f ||
+        buffer[1] != 0x8b || (buffer[3] & 4) == 0 || buffer[12] != 66 ||
+        buffer[13] != 67) {
+      callback(new Error('Not a BGZF block'));
+      return;
+    }
+    var length = buffer[16] + buffer[17] * 256 + 1;
+    if (length > read) {
+      callback(new Error('BGZF block is truncated'));
+      return;
+    }
+
+    // Block is small, so it is decompressed in calling thread.
+    var data;
+    try {
+      data = Gunzip.decompressSync(buffer.slice(0, length));
+    } catch (e) {
+      callback(e);
+      return;
+    }
+    self.blockOffset_ = offset;
+    self.block_ = { data: data, next: offset + length };
+    callback(null, self.block_);
+  });
+};
+
+
+// === AccessIndex ===
+// Access points of compressed file, as reported by decompressor with
+// indexing option. Reading at an offset starts decompression at the last
+// point preceding it, instead of the beginning of file. Common base of
+// GzipIndex and BzipIndex.
+//
+// Index file, little-endian, is 16 byte header: magic, version, number of
+// points and entry length, followed by 32 byte entries sorted by output
+// offset: output offset, input offset in bits, file offset of window (8
+// bytes each), compressed and original window length (4 bytes each). Each
+// window is stored as gzip member, empty window is not stored. Loaded index
+// keeps the entries as is and reads windows on demand, so loading costs a
+// single read of the entries.
+var INDEX_READ_LENGTH = 65536;
+var INDEX_VERSION = 1;
+var INDEX_HEADER_LENGTH = 16;
+var INDEX_ENTRY_LENGTH = 32;
+
+function getUInt32(buffer, offset) {
+  return buffer[offset] + buffer[offset + 1] * 0x100 +
+    buffer[offset + 2] * 0x10000 + buffer[offset + 3] * 0x1000000;
+}
+
+
+function putUInt32(buffer, offset, value) {
+  for (var i = 0; i < 4; ++i) {
+    buffer[offset + i] = value & 0xff;
+    value = value >>> 8;
+  }
+}
+
+
+// 64-bit values are exact up to 2^53, as JS numbers are.
+function getUInt64(buffer, offset) {
+  return getUInt32(buffer, offset) +
+    getUInt32(buffer, offset + 4) * 0x100000000;
+}
+
+
+function putUInt64(buffer, offset, value) {
+  putUInt32(buffer, offset, value % 0x100000000);
+  putUInt32(buffer, offset + 4, Math.floor(value / 0x100000000));
+}
+
+
+function AccessIndex() {
+  // Points added by add(), loaded index keeps them in table_ instead.
+  this.points = [];
+
+  // Entries and open file of loaded index, and the last point read from
+  // it, as reads are usually sequential.
+  this.table_ = null;
+  this.fd_ = null;
+  this.cachedEntry_ = -1;
+  this.cachedPoint_ = null;
+}
+
+
+// Load index of class ctor saved by save(). callback(exc, index) gets
+// index, which keeps file open until close().
+AccessIndex.load_ = function(ctor, path, callback) {
+  var magic = ctor.prototype.magic_;
+  fs.open(path, 'r', function(err, fd) {
+    if (err) {
+      callback(err);
+      return;
+    }
+
+    function fail(err) {
+      fs.close(fd, function() {
+        callback(err);
+      });
+    }
+
+    var header = new Buffer(INDEX_HEADER_LENGTH);
+    fs.read(fd, header, 0, header.length, 0, function(err, read) {
+      if (err) {
+        fail(err);
+        return;
+      }
+      if (read < header.length ||
+          header.toString('binary', 0, 4) != magic ||
+          getUInt32(header, 4) != INDEX_VERSION ||
+          getUInt32(header, 12) != INDEX_ENTRY_LENGTH) {
+        fail(new Error('Not a ' + magic + ' index'));
+        return;
+      }
+
+      // Number of entries is checked against file size, so that corrupted
+      // header does not make table huge.
+      var length = getUInt32(header, 8) * INDEX_ENTRY_LENGTH;
+      fs.fstat(fd, function(err, stats) {
+        if (err) {
+          fail(err);
+          return;
+        }
+        if (header.length + length > stats.size) {
+          fail(new Error(magic + ' index is truncated'));
+          return;
+        }
+
+        var table = new Buffer(length);
+        if (table.length == 0) {
+          done(null, 0);
+        } else {
+          fs.read(fd, table, 0, table.length, header.length, done);
+        }
+
+        function done(err, read) {
+          if (err) {
+            fail(err);
+            return;
+          }
+          if (read < table.length) {
+            fail(new Error(magic + ' index is truncated'));
+            return;
+          }
+          var index = new ctor();
+          index.table_ = table;
+          index.fd_ = fd;
+          callback(null, index);
+        }
+      });
+    });
+  });
+};
+
+
+// Number of access points.
+AccessIndex.prototype.length = function() {
+  return this.table_ !== null ? this.table_.length / INDEX_ENTRY_LENGTH :
+    this.points.length;
+};
+
+
+// Add access point. Suits as onaccesspoint handler and as 'accesspoint'
+// event listener. Points must be added in order.
+AccessIndex.prototype.add = function(input, output, window) {
+  if (this.table_ !== null) {
+    throw new Error('Loaded index is read only.');
+  }
+  this.points.push({ input: input, output: output, window: window });
+};
+
+
+// Save index to file at path, and call callback(exc) after that. Windows
+// are compressed one after another by Gzip.
+AccessIndex.prototype.save = function(path, callback) {
+  if (this.table_ !== null) {
+    throw new Error('Loaded index is read only.');
+  }
+
+  var points = this.points;
+  var table = new Buffer(INDEX_HEADER_LENGTH +
+      points.length * INDEX_ENTRY_LENGTH);
+  for (var i = 0; i < this.magic_.length; ++i) {
+    table[i] = this.magic_.charCodeAt(i);
+  }
+  putUInt32(table, 4, INDEX_VERSION);
+  putUInt32(table, 8, points.length);
+  putUInt32(table, 12, INDEX_ENTRY_LENGTH);
+
+  fs.open(path, 'w', function(err, fd) {
+    if (err) {
+      callback(err);
+      return;
+    }
+
+    function finish(err) {
+      fs.close(fd, function(closeErr) {
+        callback(err || closeErr || null);
+      });
+    }
+
+    function write(buffer, position, next) {
+      fs.write(fd, buffer, 0, buffer.length, position,
+          function(err, written) {
+        if (!err && written < buffer.length) {
+          err = new Error('Short write to index');
+        }
+        if (err) {
+          finish(err);
+        } else {
+          next();
+        }
+      });
+    }
+
+    var position = table.length;
+
+    function step(i) {
+      if (i == points.length) {
+        write(table, 0, finish);
+        return;
+      }
+
+      var point = points[i];
+      var entry = INDEX_HEADER_LENGTH + i * INDEX_ENTRY_LENGTH;
+      putUInt64(table, entry, point.output);
+      putUInt64(table, entry + 8, point.input);
+      putUInt64(table, entry + 16, position);
+      putUInt32(table, entry + 24, 0);
+      putUInt32(table, entry + 28, 0);
+      if (!point.window || point.window.length == 0) {
+        step(i + 1);
+        return;
+      }
+
+      var parts = [];
+      var total = 0;
+      var error = null;
+      function collect(err, data) {
+        if (err) {
+          error = error || err;
+        } else {
+          parts.push(data);
+          total += data.length;
+        }
+      }
+
+      var gzip = new Gzip(9);
+      gzip.setBufferOutput(true);
+      gzip.write(point.window, collect);
+      gzip.close(function(err, data) {
+        collect(err, data);
+        if (error) {
+          finish(error);
+          return;
+        }
+        putUInt32(table, entry + 24, total);
+        putUInt32(table, entry + 28, point.window.length);
+
+        var compressed = concatBuffers(parts, total);
+        write(compressed, position, function() {
+          step(i + 1);
+        });
+        position += total;
+      });
+    }
+
+    step(0);
+  });
+};
+
+
+// Close file of loaded index.
+AccessIndex.prototype.close = function(opt_callback) {
+  if (this.fd_ !== null) {
+    fs.close(this.fd_, opt_callback || function() {});
+    this.fd_ = null;
+  }
+};
+
+
+// Input offset in bits and output offset of point i.
+AccessIndex.prototype.input_ = function(i) {
+  if (this.table_ !== null) {
+    return getUInt64(this.table_, i * INDEX_ENTRY_LENGTH + 8);
+  }
+  return this.points[i].input;
+};
+
+
+AccessIndex.prototype.output_ = function(i) {
+  if (this.table_ !== null) {
+    return getUInt64(this.table_, i * INDEX_ENTRY_LENGTH);
+  }
+  return this.points[i].output;
+};
+
+
+// The last access point at or before output offset, or null. Point of
+// loaded index has no window, as windows are read on demand.
+AccessIndex.prototype.find = function(offset) {
+  var i = this.find_(offset);
+  if (i < 0) {
+    return null;
+  }
+  if (this.table_ === null) {
+    return this.points[i];
+  }
+  return { input: this.input_(i), output: this.output_(i) };
+};
+
+
+// Index of the last access point at or before output offset, or -1.
+AccessIndex.prototype.find_ = function(offset) {
+  var low = 0;
+  var high = this.length();
+  while (low < high) {
+    var middle = (low + high) >> 1;
+    if (this.output_(middle) <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low - 1;
+};
+
+
+// Get point i, reading its window from file of loaded index.
+// callback(exc, point) gets null for i = -1.
+AccessIndex.prototype.point_ = function(i, callback) {
+  if (i < 0) {
+    callback(null, null);
+    return;
+  }
+  if (this.table_ === null) {
+    callback(null, this.points[i]);
+    return;
+  }
+  if (i === this.cachedEntry_) {
+    callback(null, this.cachedPoint_);
+    return;
+  }
+
+  var self = this;
+  var entry = i * INDEX_ENTRY_LENGTH;
+  var point = {
+    input: this.input_(i),
+    output: this.output_(i),
+    window: new Buffer(0)
+  };
+  var compressed = new Buffer(getUInt32(this.table_, entry + 24));
+  var length = getUInt32(this.table_, entry + 28);
+
+  function done(err) {
+    if (err) {
+      callback(err);
+      return;
+    }
+    self.cachedEntry_ = i;
+    self.cachedPoint_ = point;
+    callback(null, point);
+  }
+
+  if (compressed.length == 0) {
+    done(null);
+    return;
+  }
+  fs.read(this.fd_, compressed, 0, compressed.length,
+      getUInt64(this.table_, entry + 16), function(err, read) {
+    if (!err && read < compressed.length) {
+      err = new Error('Index is truncated');
+    }
+    if (!err) {
+      // Window is small, so it is decompressed in calling thread.
+      try {
+        point.window = Gunzip.decompressSync(compressed);
+      } catch (e) {
+        err = e;
+      }
+    }
+    if (!err && point.window.length != length) {
+      err = new Error('Index window is corrupted');
+    }
+    done(err);
+  });
+};
+
+
+// Read up to length bytes of decompressed data at offset, i.e. range
+// [offset, offset + length), from compressed file open as fd.
+// callback(exc, buffer) gets less data only at the end of file.
+AccessIndex.prototype.read = function(fd, offset, length, callback) {
+  var self = this;
+  var end = this.inputEnd_(offset + length);
+  this.point_(this.find_(offset), function(err, point) {
+    if (err) {
+      callback(err);
+    } else {
+      self.readFrom_(fd, point, end, offset, length, callback);
+    }
+  });
+};
+
+
+// Input offset in bytes, which is enough to read to decompress output up
+// to offset, or -1 for the whole input.
+AccessIndex.prototype.inputEnd_ = function(offset) {
+  return -1;
+};
+
+
+// Read input up to end and decompress it by decompressor started at point.
+AccessIndex.prototype.readFrom_ = function(fd, point, end, offset, length,
+    callback) {
+  var decompressor;
+  try {
+    decompressor = this.createDecompressor_(point, offset + length);
+  } catch (e) {
+    callback(e);
+    return;
+  }
+  decompressor.setBufferOutput(true);
+
+  var position = point ? Math.floor(point.input / 8) : 0;
+  var skip = offset - (point ? point.output : 0);
+  var buffer = new Buffer(INDEX_READ_LENGTH);
+  var parts = [];
+  var total = 0;
+
+  function collect(data) {
+    if (skip >= data.length) {
+      skip -= data.length;
+      return;
+    }
+    var stop = Math.min(data.length, skip + length - total);
+    parts.push(data.slice(skip, stop));
+    total += stop - skip;
+    skip = 0;
+  }
+
+  function close() {
+    decompressor.close(function(err, data) {
+      if (err) {
+        decompressor.destroy();
+        callback(err);
+        return;
+      }
+      collect(data);
+      callback(null, concatBuffers(parts, total));
+    });
+  }
+
+  function step() {
+    var count = buffer.length;
+    if (end >= 0 && end - position < count) {
+      count = end - position;
+    }
+    if (count <= 0) {
+      close();
+      return;
+    }
+
+    fs.read(fd, buffer, 0, count, position, function(err, read) {
+      if (err) {
+        decompressor.destroy();
+        callback(err);
+        return;
+      }
+      if (read == 0) {
+        close();
+        return;
+      }
+
+      position += read;
+      decompressor.write(buffer.slice(0, read), function(err, data) {
+        if (err) {
+          decompressor.destroy();
+          callback(err);
+          return;
+        }
+        collect(data);
+        if (total == length) {
+          decompressor.destroy();
+          callback(null, concatBuffers(parts, total));
+        } else {
+          step();
+        }
+      });
+    });
+  }
+
+  step();
+};
+
+
+// === GzipIndex ===
+// Access points of gzip file, reported by Gunzip with indexSpan option.
+function GzipIndex() {
+  AccessIndex.call(this);
+}
+inherits(GzipIndex, AccessIndex);
+
+GzipIndex.prototype.magic_ = 'GZIX';
+
+
+GzipIndex.load = function(path, callback) {
+  AccessIndex.load_(GzipIndex, path, callback);
+};
+
+
+GzipIndex.prototype.createDecompressor_ = function(point) {
+  return point ? new Gunzip({ accessPoint: point }) : new Gunzip();
+};
+
+
+// === BzipIndex ===
+// Blocks of bzip2 file, reported by ParallelBunzip with index option.
+var BZIP_MAGIC_BITS = 48;
+
+function BzipIndex() {
+  AccessIndex.call(this);
+}
+inherits(BzipIndex, AccessIndex);
+
+BzipIndex.prototype.magic_ = 'BZIX';
+
+
+BzipIndex.load = function(path, callback) {
+  AccessIndex.load_(BzipIndex, path, callback);
+};
+
+
+// Decompressor is told where input is cut, so that truncated file is still
+// reported as such.
+BzipIndex.prototype.createDecompressor_ = function(point, offset) {
+  var options = point ? { accessPoint: point } : {};
+  var next = this.nextBlock_(offset);
+  if (next >= 0) {
+    options.endBit = next;
+  }
+  return new ParallelBunzip(false, options);
+};
+
+
+// Blocks are read up to the magic of the block following the last one
+// needed, so that ParallelBunzip finds the end of the latter.
+BzipIndex.prototype.inputEnd_ = function(offset) {
+  var next = this.nextBlock_(offset);
+  return next < 0 ? -1 : Math.ceil((next + BZIP_MAGIC_BITS) / 8);
+};
+
+
+// Bit offset of the block following the one containing output offset - 1,
+// or -1 if there is none.
+BzipIndex.prototype.nextBlock_ = function(offset) {
+  var next = this.find_(offset - 1) + 1;
+  if (next == 0 || next == this.length()) {
+    return -1;
+  }
+  return this.input_(next);
+};
+
+
 exports.Gzip = Gzip;
 exports.Gunzip = Gunzip;
+exports.Deflate = Deflate;
+exports.Inflate = Inflate;
+exports.DeflateRaw = DeflateRaw;
+exports.InflateRaw = InflateRaw;
+exports.AutoDecompress = AutoDecompress;
+exports.ParallelGzip = ParallelGzip;
+exports.ParallelGunzip = ParallelGunzip;
 exports.Bzip = Bzip;
 exports.Bunzip = Bunzip;
+exports.ParallelBzip = ParallelBzip;
+exports.ParallelBunzip = ParallelBunzip;
+exports.Bgzf = Bgzf;
+exports.Dictionary = Dictionary;
+exports.trainDictionary = trainDictionary;
+exports.BgzfReader = BgzfReader;
+exports.GzipIndex = GzipIndex;
+exports.BzipIndex = BzipIndex;
 
 exports.GzipStream = GzipStream;
 exports.GunzipStream = GunzipStream;
+exports.DeflateStream = DeflateStream;
+exports.InflateStream = InflateStream;
+exports.DeflateRawStream = DeflateRawStream;
+exports.InflateRawStream = InflateRawStream;
+exports.AutoDecompressStream = AutoDecompressStream;
+exports.ParallelGzipStream = ParallelGzipStream;
+exports.ParallelGunzipStream = ParallelGunzipStream;
 exports.BzipStream = BzipStream;
 exports.BunzipStream = BunzipStream;
+exports.ParallelBzipStream = ParallelBzipStream;
+exports.ParallelBunzipStream = ParallelBunzipStream;
+exports.BgzfStream = BgzfStream;
 
 exports.setApiWarnings = setApiWarnings;
@@ -0,0 +1,292 @@
+/*
+ * Copyright 2010, Ivan Egorov (egorich.3.04@gmail.com).
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Decompressor of any format supported by library. Included after gzip.cc
+// and, if built with bzip support, after bzip.cc.
+
+#include <node.h>
+#include <node_events.h>
+#include <node_buffer.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "zlib.h"
+
+using namespace v8;
+using namespace node;
+
+
+// Statuses are those of zlib. Bzip errors are passed as BzipErrors plus
+// bzip status, so that their messages are kept.
+class AutoDecompressUtils : public GzipUtils {
+ public:
+  static const int BzipErrors = -100;
+
+ public:
+  static bool IsError(int status) {
+    return GzipUtils::IsError(status);
+  }
+
+
+  static Local<Value> GetException(int status) {
+#ifdef WITH_BZIP
+    if (status <= BzipErrors) {
+      return BzipUtils::GetException(status - BzipErrors);
+    }
+#endif
+    return GzipUtils::GetException(status);
+  }
+};
+
+
+class AutoDecompressImpl {
+  friend class ZipLib<AutoDecompressImpl>;
+
+  typedef AutoDecompressUtils Utils;
+  typedef AutoDecompressUtils::Blob Blob;
+
+ private:
+  static const char Name[];
+
+  static const bool InlineWrites = true;
+
+ private:
+  enum Format {
+    FormatUnknown,
+    FormatDeflate,
+    FormatBzip
+  };
+
+ private:
+  AutoDecompressImpl()
+    : format_(FormatUnknown), headLength_(0), headOffset_(0)
+  {}
+
+
+  // Options are dictionary, for zlib and raw deflate input, and small, to
+  // decompress bzip2 input using less memory, as Bunzip does.
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    // Dictionary is not used, if input is gzip or bzip2.
+    if (args.Length() > 0 &&
+        !Dictionary::GetOption(args[0], inflate_.dictionary_)) {
+      return Undefined();
+    }
+#ifdef WITH_BZIP
+    bunzip_.small_ = 0;
+    if (args.Length() > 0 && args[0]->IsObject()) {
+      Local<Value> small = args[0]->ToObject()->Get(String::NewSymbol("small"));
+      bunzip_.small_ = small->BooleanValue() ? 1 : 0;
+    }
+#endif
+    return Undefined();
+  }
+
+
+  // The first HeadLength bytes of input are kept to detect format. The
+  // rest of input is passed to decompressor as is.
+  int Write(char *data, int &dataLength, Blob &out) {
+    if (format_ == FormatUnknown) {
+      int length = HeadLength - headLength_;
+      if (length > dataLength) {
+        length = dataLength;
+      }
+      memcpy(head_ + headLength_, data, length);
+      headLength_ += length;
+      data += length;
+      dataLength -= length;
+      COND_RETURN(headLength_ < HeadLength, Z_OK);
+      int ret = Start();
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    if (headOffset_ < headLength_) {
+      int length = headLength_ - headOffset_;
+      int ret = Decompress(head_ + headOffset_, length, out);
+      headOffset_ = headLength_ - length;
+      COND_RETURN(Utils::IsError(ret) || ret == Z_STREAM_END, ret);
+      COND_RETURN(headOffset_ < headLength_, Z_OK);
+    }
+    return Decompress(data, dataLength, out);
+  }
+
+
+  // Pick decompressor by magic of input: gzip member, zlib header, whose
+  // check bits make random match unlikely, or bzip2 stream. Anything else
+  // is taken for raw deflate.
+  int Start() {
+    const unsigned char *head = reinterpret_cast<unsigned char*>(head_);
+    if (headLength_ >= 2 && head[0] == 0x1f && head[1] == 0x8b) {
+      return StartDeflate(GzipUtils::FormatGzip);
+    }
+    if (headLength_ >= 2 && (head[0] & 0x0f) == Z_DEFLATED &&
+        (head[0] >> 4) <= MAX_WBITS - 8 &&
+        ((head[0] << 8) | head[1]) % 31 == 0) {
+      return StartDeflate(GzipUtils::FormatZlib);
+    }
+#ifdef WITH_BZIP
+    if (headLength_ >= 3 && memcmp(head, "BZh", 3) == 0) {
+      int ret = GetStatus(bunzip_.InitStream());
+      if (!Utils::IsError(ret)) {
+        format_ = FormatBzip;
+      }
+      return ret;
+    }
+#endif
+    return StartDeflate(GzipUtils::FormatRaw);
+  }
+
+
+  int StartDeflate(GzipUtils::Format format) {
+    inflate_.format_ = format;
+    int ret = inflate_.InitStream();
+    if (!Utils::IsError(ret)) {
+      format_ = FormatDeflate;
+    }
+    return ret;
+  }
+
+
+  int Decompress(char *data, int &dataLength, Blob &out) {
+#ifdef WITH_BZIP
+    if (format_ == FormatBzip) {
+      // Output goes directly to out.
+      BzipUtils::Blob output;
+      output.Borrow(reinterpret_cast<char*>(out.data() + out.length()),
+          out.avail());
+      int ret = bunzip_.Write(data, dataLength, output);
+      out.IncreaseLengthBy(output.length());
+      return GetStatus(ret);
+    }
+#endif
+    return inflate_.Write(data, dataLength, out);
+  }
+
+
+#ifdef WITH_BZIP
+  static int GetStatus(int bzipStatus) {
+    if (bzipStatus == BZ_STREAM_END) {
+      return Z_STREAM_END;
+    }
+    if (!BzipUtils::IsError(bzipStatus)) {
+      return Z_OK;
+    }
+    if (bzipStatus == BZ_MEM_ERROR) {
+      return Z_MEM_ERROR;
+    }
+    return Utils::BzipErrors + bzipStatus;
+  }
+#endif
+
+
+  size_t WriteSizeHint(int dataLength) {
+#ifdef WITH_BZIP
+    if (format_ == FormatBzip) {
+      return bunzip_.WriteSizeHint(dataLength + headLength_ - headOffset_);
+    }
+#endif
+    return inflate_.WriteSizeHint(dataLength + headLength_ - headOffset_);
+  }
+
+
+  // Input shorter than HeadLength still needs decompression.
+  size_t FinishSizeHint() {
+    return WriteSizeHint(0);
+  }
+
+
+  // Decompressor outputs as much as possible anyway, so flush does nothing,
+  // but mode is checked as for compressor.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
+    return Z_OK;
+  }
+
+
+  int Finish(Blob &out) {
+    if (format_ == FormatUnknown) {
+      int ret = Start();
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    if (headOffset_ < headLength_) {
+      int length = headLength_ - headOffset_;
+      int ret = Decompress(head_ + headOffset_, length, out);
+      headOffset_ = headLength_ - length;
+      COND_RETURN(Utils::IsError(ret) || headOffset_ < headLength_, ret);
+    }
+#ifdef WITH_BZIP
+    if (format_ == FormatBzip) {
+      BzipUtils::Blob output;
+      return GetStatus(bunzip_.Finish(output));
+    }
+#endif
+    return inflate_.Finish(out);
+  }
+
+
+  // Members are reported as by decompressor of detected format.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {
+#ifdef WITH_BZIP
+    bunzip_.TakeBoundaries(boundaries);
+#endif
+    inflate_.TakeBoundaries(boundaries);
+  }
+
+
+  // Input is not indexed.
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
+  void Destroy() {
+#ifdef WITH_BZIP
+    if (format_ == FormatBzip) {
+      bunzip_.Destroy();
+    }
+#endif
+    if (format_ == FormatDeflate) {
+      inflate_.Destroy();
+    }
+  }
+
+ private:
+  // Enough to tell bzip2 stream.
+  static const int HeadLength = 3;
+
+  Format format_;
+
+  // The first bytes of input, and how many of them are decompressed.
+  char head_[HeadLength];
+  int headLength_;
+  int headOffset_;
+
+  GunzipImpl inflate_;
+#ifdef WITH_BZIP
+  BunzipImpl bunzip_;
+#endif
+};
+const char AutoDecompressImpl::Name[] = "AutoDecompress";
+typedef ZipLib<AutoDecompressImpl> AutoDecompress;
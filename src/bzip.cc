@@ -31,6 +31,7 @@
 #undef BZ_NO_STDIO
 
 #include "utils.h"
+#include "parallel.h"
 #include "zlib.h"
 
 using namespace v8;
@@ -100,6 +101,17 @@ class BzipUtils {
     }
   }
 
+  // Flush mode of flush(), which is BZ_FLUSH for both 'sync', the default,
+  // and 'full'. Returns false, if mode is unknown.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    mode = BZ_FLUSH;
+    if (value.IsEmpty() || value->IsUndefined()) {
+      return true;
+    }
+    String::AsciiValue name(value);
+    return strcmp(*name, "sync") == 0 || strcmp(*name, "full") == 0;
+  }
+
  private:
   static const char ConfigError[];
   static const char SequenceError[];
@@ -124,6 +136,7 @@ const char BzipUtils::OutbuffFull[] = "Output buffer full.";
 
 class BzipImpl {
   friend class ZipLib<BzipImpl>;
+  friend class ParallelBzipImpl;
 
   typedef BzipUtils Utils;
   typedef BzipUtils::Blob Blob;
@@ -131,8 +144,15 @@ class BzipImpl {
  private:
   static const char Name[];
 
+  // Writes estimated to be cheap may be processed in V8 thread.
+  static const bool InlineWrites = true;
+
+  // Initial output space for the last block, which is compressed by
+  // Finish() only.
+  static const size_t FinishChunk = 16 * 1024;
+
  private:
-  Handle<Value> Init(const Arguments &args) {
+  Handle<Value> Init(const ArgumentsView &args) {
     HandleScope scope;
 
     int blockSize100k = 1;
@@ -177,6 +197,31 @@ class BzipImpl {
 
     int ret = BZ2_bzCompress(&stream_, BZ_RUN);
     dataLength = stream_.avail_in;
+    if (ret == BZ_PARAM_ERROR && initAvail == stream_.avail_out &&
+        dataLength == 0) {
+      // No progress possible, i.e. no input and no pending output.
+      ret = BZ_RUN_OK;
+    }
+    if (!Utils::IsError(ret)) {
+      out.IncreaseLengthBy(initAvail - stream_.avail_out);
+    }
+    return ret;
+  }
+
+
+  // Bzip blocks are independent, so both modes just end current block.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
+    stream_.avail_in = 0;
+    stream_.next_in = NULL;
+    stream_.next_out = out.data() + out.length();
+    size_t initAvail = stream_.avail_out = out.avail();
+
+    int ret = BZ2_bzCompress(&stream_, mode);
     if (!Utils::IsError(ret)) {
       out.IncreaseLengthBy(initAvail - stream_.avail_out);
     }
@@ -184,6 +229,18 @@ class BzipImpl {
   }
 
 
+  // Expected output size for dataLength bytes of input, according to bzip2
+  // documentation output is at most 1% larger than input, plus 600 bytes.
+  size_t WriteSizeHint(int dataLength) {
+    return dataLength + dataLength / 100 + 600;
+  }
+
+
+  size_t FinishSizeHint() {
+    return FinishChunk;
+  }
+
+
   int Finish(Blob &out) {
     stream_.next_out = out.data() + out.length();
     size_t initAvail = stream_.avail_out = out.avail();
@@ -196,6 +253,13 @@ class BzipImpl {
   }
 
 
+  // Compressor input is not split into members, nor indexed.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {}
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
   void Destroy() {
     BZ2_bzCompressEnd(&stream_);
   }
@@ -208,8 +272,286 @@ const char BzipImpl::Name[] = "Bzip";
 typedef ZipLib<BzipImpl> Bzip;
 
 
+// Compression of single block of ParallelBzipImpl as independent bzip2
+// stream.
+class BzipBlockJob : public ParallelOutputJob<BzipUtils::Blob> {
+  friend class ParallelBzipImpl;
+
+ public:
+  BzipBlockJob(int blockSize100k, int workFactor)
+    : blockSize100k_(blockSize100k), workFactor_(workFactor)
+  {}
+
+ protected:
+  virtual void Run() {
+    bz_stream stream;
+    stream.bzalloc = NULL;
+    stream.bzfree = NULL;
+    stream.opaque = NULL;
+    status_ = BZ2_bzCompressInit(&stream, blockSize100k_, 0, workFactor_);
+    if (Utils::IsError(status_)) {
+      return;
+    }
+
+    size_t length = input_.length();
+    if (!output_.Reserve(length + length / 100 + 600)) {
+      status_ = BZ_MEM_ERROR;
+    } else {
+      stream.next_in = input_.data();
+      stream.avail_in = length;
+      stream.next_out = output_.data();
+      stream.avail_out = output_.avail();
+
+      status_ = BZ2_bzCompress(&stream, BZ_FINISH);
+      output_.IncreaseLengthBy(output_.avail() - stream.avail_out);
+      if (status_ == BZ_STREAM_END) {
+        status_ = BZ_OK;
+      } else if (!Utils::IsError(status_)) {
+        // Output bound was not enough.
+        status_ = BZ_OUTBUFF_FULL;
+      }
+    }
+    BZ2_bzCompressEnd(&stream);
+
+    // Input is not needed anymore.
+    input_.Free();
+  }
+
+ private:
+  typedef BzipUtils Utils;
+
+  int blockSize100k_;
+  int workFactor_;
+
+  Blob input_;
+};
+
+
+// Bzip compressor, which cuts input into blocks and compresses them on
+// several threads, as pbzip2 does. Each block is compressed as independent
+// bzip2 stream, and output is concatenation of those, which is accepted by
+// bunzip2.
+class ParallelBzipImpl {
+  friend class ZipLib<ParallelBzipImpl>;
+
+  typedef BzipUtils Utils;
+  typedef BzipUtils::Blob Blob;
+
+ private:
+  static const char Name[];
+
+  // Write may wait for earlier blocks, so it is never done in V8 thread.
+  static const bool InlineWrites = false;
+
+  static const int MaxThreads = 256;
+
+ private:
+  ParallelBzipImpl()
+    : block_(0)
+  {}
+
+
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    blockSize100k_ = 9;
+    workFactor_ = 0;
+    threads_ = ParallelPool::DefaultThreads();
+
+    int length = args.Length();
+    if (length >= 1 && !args[0]->IsUndefined()) {
+      if (!args[0]->IsInt32() || args[0]->Int32Value() < 1 ||
+          args[0]->Int32Value() > 9) {
+        Local<Value> exception = Exception::TypeError(
+            String::New("blockSize must be an integer in range [1, 9]"));
+        return ThrowException(exception);
+      }
+      blockSize100k_ = args[0]->Int32Value();
+    }
+    if (length >= 2 && !args[1]->IsUndefined()) {
+      if (!args[1]->IsInt32()) {
+        Local<Value> exception = Exception::TypeError(
+            String::New("workFactor must be an integer"));
+        return ThrowException(exception);
+      }
+      workFactor_ = args[1]->Int32Value();
+    }
+    if (length >= 3 &&
+        !GetIntegerOption(args[2], "threads", 1, MaxThreads, threads_)) {
+      return Undefined();
+    }
+
+    // Block of that size fits single bzip2 block, unless it expands by
+    // initial run-length encoding.
+    blockLength_ = blockSize100k_ * 100000;
+    submitted_ = false;
+    return Undefined();
+  }
+
+
+  int Write(char *data, int &dataLength, Blob &out) {
+    int ret = Drain(out, false);
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    while (dataLength > 0) {
+      if (jobs_.length() >= Backlog()) {
+        // Caller is ahead of compression.
+        ret = Drain(out, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (jobs_.length() >= Backlog()) {
+          // Output is full.
+          break;
+        }
+      }
+
+      if (block_ == 0) {
+        block_ = new(std::nothrow) BzipBlockJob(blockSize100k_, workFactor_);
+        COND_RETURN(block_ == 0, BZ_MEM_ERROR);
+        COND_RETURN(!block_->input_.GrowBy(blockLength_), BZ_MEM_ERROR);
+      }
+      size_t length = blockLength_ - block_->input_.length();
+      if (length > static_cast<size_t>(dataLength)) {
+        length = dataLength;
+      }
+      memcpy(block_->input_.data() + block_->input_.length(), data, length);
+      block_->input_.IncreaseLengthBy(length);
+      data += length;
+      dataLength -= length;
+
+      if (block_->input_.length() == blockLength_) {
+        ret = Submit();
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+    }
+    return Drain(out, false);
+  }
+
+
+  // Output of already compressed blocks. Geometric growth of output takes
+  // care of the rest.
+  size_t WriteSizeHint(int dataLength) {
+    return jobs_.ReadyLength();
+  }
+
+
+  // Upper bound of output for all the input written.
+  size_t FinishSizeHint() {
+    size_t length = jobs_.ReadyLength();
+    for (size_t i = 0; i < jobs_.length(); ++i) {
+      BzipBlockJob *job = jobs_[i];
+      if (!ParallelPool::Done(job)) {
+        length += BlockBound(job->input_.length());
+      }
+    }
+    return length + BlockBound(block_ != 0 ? block_->input_.length() : 0);
+  }
+
+
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return BzipImpl::GetFlushMode(value, mode);
+  }
+
+
+  // Compress buffered input as separate stream and pass all the output.
+  int Flush(int mode, Blob &out) {
+    if (block_ != 0) {
+      int ret = Submit();
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    return Drain(out, true);
+  }
+
+
+  int Finish(Blob &out) {
+    if (block_ != 0 || !submitted_) {
+      // Empty input still makes valid bzip2 stream.
+      if (block_ == 0) {
+        block_ = new(std::nothrow) BzipBlockJob(blockSize100k_, workFactor_);
+        COND_RETURN(block_ == 0, BZ_MEM_ERROR);
+      }
+      int ret = Submit();
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+
+    int ret = Drain(out, true);
+    COND_RETURN(Utils::IsError(ret), ret);
+    return jobs_.length() == 0 ? BZ_STREAM_END : BZ_FINISH_OK;
+  }
+
+
+  // Compressor input is not split into members, nor indexed.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {}
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
+  void Destroy() {
+    jobs_.Clear();
+    delete block_;
+    block_ = 0;
+  }
+
+ private:
+  // Queue current block for compression.
+  int Submit() {
+    BzipBlockJob *job = block_;
+    block_ = 0;
+    submitted_ = true;
+    COND_RETURN(!jobs_.Push(job, threads_), BZ_MEM_ERROR);
+    return BZ_OK;
+  }
+
+
+  // Pass output of compressed blocks in order, while output space is
+  // available. If wait is true, wait for blocks being compressed, so that
+  // output size hints account for them.
+  int Drain(Blob &out, bool wait) {
+    while (jobs_.FrontDone(wait)) {
+      BzipBlockJob *job = jobs_.Front();
+      COND_RETURN(Utils::IsError(job->status()), job->status());
+      if (!jobs_.CopyFront(out)) {
+        break;
+      }
+      delete jobs_.Pop();
+    }
+    return BZ_OK;
+  }
+
+
+  // Maximum number of blocks queued for compression or waiting for output.
+  size_t Backlog() const {
+    return 2 * threads_;
+  }
+
+
+  static size_t BlockBound(size_t length) {
+    return length + length / 100 + 600;
+  }
+
+ private:
+  int blockSize100k_;
+  int workFactor_;
+  int threads_;
+  size_t blockLength_;
+
+  // Blocks being compressed or waiting for output, in order.
+  ParallelQueue<BzipBlockJob> jobs_;
+
+  // Block being filled by input, or 0.
+  BzipBlockJob *block_;
+
+  // Whether any block was submitted, i.e. whether output is valid bzip2
+  // stream.
+  bool submitted_;
+};
+const char ParallelBzipImpl::Name[] = "ParallelBzip";
+typedef ZipLib<ParallelBzipImpl> ParallelBzip;
+
+
 class BunzipImpl {
   friend class ZipLib<BunzipImpl>;
+  friend class AutoDecompressImpl;
 
   typedef BzipUtils Utils;
   typedef BzipUtils::Blob Blob;
@@ -217,22 +559,26 @@ class BunzipImpl {
  private:
   static const char Name[];
 
+  static const bool InlineWrites = true;
+
+  // Typical compression ratio of bzipped data.
+  static const size_t ExpectedRatio = 5;
+
  public:
-  Handle<Value> Init(const Arguments &args) {
+  BunzipImpl()
+    : streamEnded_(false), input_(0), output_(0)
+  {}
+
+
+  Handle<Value> Init(const ArgumentsView &args) {
     HandleScope scope;
 
-    int small = 0;
+    small_ = 0;
     if (args.Length() > 0 && !args[0]->IsUndefined()) {
-      small = args[0]->BooleanValue() ? 1 : 0;
+      small_ = args[0]->BooleanValue() ? 1 : 0;
     }
 
-    stream_.bzalloc = NULL;
-    stream_.bzfree = NULL;
-    stream_.opaque = NULL;
-    stream_.avail_in = 0;
-    stream_.next_in = NULL;
-
-    int ret = BZ2_bzDecompressInit(&stream_, 0, small);
+    int ret = InitStream();
     if (Utils::IsError(ret)) {
       return ThrowException(Utils::GetException(ret));
     }
@@ -240,7 +586,19 @@ class BunzipImpl {
   }
 
 
+  // Input might consist of several bzip2 streams, as made by pbzip2 and
+  // lbzip2, which are decompressed as single one. Data following the last
+  // stream, which is not bzip2 stream, is ignored, as bzip2 does.
   int Write(const char *data, int &dataLength, Blob &out) {
+    if (streamEnded_) {
+      COND_RETURN(dataLength == 0, BZ_OK);
+      COND_RETURN(data[0] != StreamMagic, BZ_STREAM_END);
+      BZ2_bzDecompressEnd(&stream_);
+      int ret = InitStream();
+      COND_RETURN(Utils::IsError(ret), ret);
+      streamEnded_ = false;
+    }
+
     stream_.next_in = const_cast<char*>(data);
     stream_.avail_in = dataLength;
     stream_.next_out = out.data() + out.length();
@@ -251,21 +609,762 @@ class BunzipImpl {
     if (!Utils::IsError(ret)) {
       out.IncreaseLengthBy(initAvail - stream_.avail_out);
     }
+    if (ret == BZ_STREAM_END) {
+      // Next stream, if any, is checked when its input comes.
+      streamEnded_ = true;
+      ret = EndStream();
+    }
     return ret;
   }
 
 
-  int Finish(Blob &out) {
+  int InitStream() {
+    stream_.bzalloc = NULL;
+    stream_.bzfree = NULL;
+    stream_.opaque = NULL;
+    stream_.avail_in = 0;
+    stream_.next_in = NULL;
+    return BZ2_bzDecompressInit(&stream_, 0, small_);
+  }
+
+
+  int EndStream() {
+    input_ += (static_cast<uint64_t>(stream_.total_in_hi32) << 32) |
+      stream_.total_in_lo32;
+    output_ += (static_cast<uint64_t>(stream_.total_out_hi32) << 32) |
+      stream_.total_out_lo32;
+    MemberBoundary boundary = { input_, output_ };
+    return boundaries_.Push(boundary) ? BZ_OK : BZ_MEM_ERROR;
+  }
+
+
+  // Expected output size for dataLength bytes of input.
+  size_t WriteSizeHint(int dataLength) {
+    return dataLength * ExpectedRatio + 1;
+  }
+
+
+  size_t FinishSizeHint() {
+    return 0;
+  }
+
+
+  // Decompressor outputs as much as possible anyway, so flush does nothing,
+  // but mode is checked as for compressor.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
     return BZ_OK;
   }
 
 
+  int Finish(Blob &out) {
+    // Input must end at stream boundary.
+    return streamEnded_ ? BZ_STREAM_END : BZ_UNEXPECTED_EOF;
+  }
+
+
+  // Streams are reported as members.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {
+    MoveBoundaries(boundaries_, boundaries);
+  }
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
   void Destroy() {
     BZ2_bzDecompressEnd(&stream_);
   }
 
  private:
+  // First byte of bzip2 stream.
+  static const char StreamMagic = 'B';
+
+  int small_;
   bz_stream stream_;
+
+  // Whether input so far ends at stream boundary.
+  bool streamEnded_;
+
+  // Input and output of streams ended so far, and their ends not yet taken.
+  uint64_t input_;
+  uint64_t output_;
+  Queue<MemberBoundary> boundaries_;
 };
 const char BunzipImpl::Name[] = "Bunzip";
 typedef ZipLib<BunzipImpl> Bunzip;
+
+
+// Bit-level access to bzip2 data, which is not byte aligned past stream
+// header.
+class BzipBits {
+ public:
+  // Read length <= 32 bits at bit position of data, most significant first.
+  static uint32_t Read(const char *data, uint64_t position, int length) {
+    uint32_t result = 0;
+    for (int i = 0; i < length; ++i, ++position) {
+      unsigned char byte = data[position >> 3];
+      result = (result << 1) | ((byte >> (7 - (position & 7))) & 1);
+    }
+    return result;
+  }
+
+
+  // Accumulates bits and writes them out by bytes.
+  class Writer {
+   public:
+    explicit Writer(char *data)
+      : data_(data), buffer_(0), length_(0)
+    {}
+
+    // Append length <= 32 bits of value.
+    void Put(uint32_t value, int length) {
+      buffer_ = (buffer_ << length) | (value & ((1ULL << length) - 1));
+      length_ += length;
+      while (length_ >= 8) {
+        length_ -= 8;
+        *data_++ = static_cast<char>(buffer_ >> length_);
+      }
+    }
+
+    // Append length bits at bit offset < 8 of data.
+    void Copy(const char *data, int offset, uint64_t length) {
+      const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+      uint64_t whole = length >> 3;
+      for (uint64_t i = 0; i < whole; ++i) {
+        uint32_t byte = bytes[i] << offset;
+        if (offset != 0) {
+          byte |= bytes[i + 1] >> (8 - offset);
+        }
+        Put(byte, 8);
+      }
+      int rest = static_cast<int>(length & 7);
+      if (rest != 0) {
+        Put(Read(data, whole * 8 + offset, rest), rest);
+      }
+    }
+
+    // Pad with zero bits to byte boundary. Returns end of written data.
+    char* Flush() {
+      if (length_ != 0) {
+        Put(0, 8 - length_);
+      }
+      return data_;
+    }
+
+   private:
+    char *data_;
+    uint64_t buffer_;
+    int length_;
+  };
+};
+
+
+// Part of bzip2 input between two consecutive magics, starting at its
+// magic: either a block, which is decoded as single-block stream, or stream
+// trailer with header of next stream, if any.
+class BunzipRangeJob : public ParallelOutputJob<BzipUtils::Blob> {
+  friend class ParallelBunzipImpl;
+
+ public:
+  BunzipRangeJob(bool block, int small)
+    : block_(block), last_(false), merged_(false), small_(small),
+    position_(0), bitOffset_(0), bitLength_(0)
+  {}
+
+  // Bits of this range followed by bits of next one.
+  BunzipRangeJob* Merge(BunzipRangeJob *next) {
+    BunzipRangeJob *result = new(std::nothrow) BunzipRangeJob(block_, small_);
+    if (result == 0) {
+      return 0;
+    }
+    // Next range starts in the byte, where this one ends.
+    size_t prefix = (bitOffset_ + bitLength_) >> 3;
+    if (!result->input_.GrowBy(prefix + next->input_.length())) {
+      delete result;
+      return 0;
+    }
+    memcpy(result->input_.data(), input_.data(), prefix);
+    memcpy(result->input_.data() + prefix, next->input_.data(),
+        next->input_.length());
+    result->input_.IncreaseLengthBy(prefix + next->input_.length());
+    result->position_ = position_;
+    result->bitOffset_ = bitOffset_;
+    result->bitLength_ = bitLength_ + next->bitLength_;
+    result->last_ = next->last_;
+    result->merged_ = true;
+    return result;
+  }
+
+
+  // Whether range holds stored CRC following its magic.
+  bool complete() const {
+    return bitLength_ >= MagicLength + 32;
+  }
+
+
+  // Stored CRC following magic of block or stream trailer.
+  uint32_t crc() const {
+    return BzipBits::Read(input_.data(), bitOffset_ + MagicLength, 32);
+  }
+
+ protected:
+  virtual void Run() {
+    if (!block_) {
+      status_ = BZ_OK;
+      return;
+    }
+    if (!complete()) {
+      status_ = BZ_UNEXPECTED_EOF;
+      return;
+    }
+
+    // Wrap block into stream with the largest block size, and trailer, which
+    // CRC of single block is the same as block CRC.
+    Blob stream;
+    size_t length = HeaderLength + ((bitLength_ + 7) >> 3) + TrailerLength;
+    if (!stream.GrowBy(length)) {
+      status_ = BZ_MEM_ERROR;
+      return;
+    }
+    memcpy(stream.data(), "BZh9", HeaderLength);
+    BzipBits::Writer writer(stream.data() + HeaderLength);
+    writer.Copy(input_.data(), bitOffset_, bitLength_);
+    writer.Put(EosMagic >> 32, 16);
+    writer.Put(static_cast<uint32_t>(EosMagic), 32);
+    writer.Put(crc(), 32);
+    stream.IncreaseLengthBy(writer.Flush() - stream.data());
+
+    bz_stream bz;
+    bz.bzalloc = NULL;
+    bz.bzfree = NULL;
+    bz.opaque = NULL;
+    status_ = BZ2_bzDecompressInit(&bz, 0, small_);
+    if (Utils::IsError(status_)) {
+      return;
+    }
+
+    bz.next_in = stream.data();
+    bz.avail_in = stream.length();
+    size_t hint = input_.length() * ExpectedRatio;
+    do {
+      if (!output_.Reserve(hint)) {
+        status_ = BZ_MEM_ERROR;
+        break;
+      }
+      bz.next_out = output_.data() + output_.length();
+      size_t initAvail = bz.avail_out = output_.avail();
+      status_ = BZ2_bzDecompress(&bz);
+      output_.IncreaseLengthBy(initAvail - bz.avail_out);
+      if (status_ == BZ_OK && bz.avail_in == 0 && bz.avail_out != 0) {
+        status_ = BZ_UNEXPECTED_EOF;
+      }
+    } while (status_ == BZ_OK);
+    BZ2_bzDecompressEnd(&bz);
+
+    if (status_ == BZ_STREAM_END) {
+      status_ = BZ_OK;
+    }
+  }
+
+ private:
+  typedef BzipUtils Utils;
+
+  static const size_t HeaderLength = 4;
+  static const size_t TrailerLength = 11;
+  static const int MagicLength = 48;
+  static const uint64_t BlockMagic = 0x314159265359ULL;
+  static const uint64_t EosMagic = 0x177245385090ULL;
+  static const size_t ExpectedRatio = 5;
+
+  // Whether range is block, rather than stream trailer.
+  bool block_;
+  // Whether range ends with input, and whether it is made of several ones.
+  bool last_;
+  bool merged_;
+  int small_;
+
+  // Bytes containing range, input offset of the first one, range bit offset
+  // within it and its length in bits.
+  Blob input_;
+  uint64_t position_;
+  int bitOffset_;
+  uint64_t bitLength_;
+};
+
+
+// Bunzip decompressor, which decodes blocks on several threads. Input is
+// scanned for 48-bit block and end of stream magics, which are not byte
+// aligned, and each block is decoded as separate stream. Magic might occur
+// inside compressed data, then block fails to decode and is merged with the
+// next one. Concatenated streams are decoded as single one.
+class ParallelBunzipImpl {
+  friend class ZipLib<ParallelBunzipImpl>;
+
+  typedef BzipUtils Utils;
+  typedef BzipUtils::Blob Blob;
+  typedef BunzipRangeJob Job;
+
+ private:
+  static const char Name[];
+
+  // Write may wait for earlier blocks, so it is never done in V8 thread.
+  static const bool InlineWrites = false;
+
+  static const int MaxThreads = 256;
+
+  // Input scanned at once, so that blocks are submitted in time.
+  static const int ScanChunk = 64 * 1024;
+
+  // Compressed block of maximum size takes less, even for worst case data.
+  static const size_t MaxRangeLength = 4 << 20;
+
+  static const size_t ExpectedRatio = 5;
+
+ private:
+  ParallelBunzipImpl()
+    : base_(0), scanned_(0), register_(0), started_(false), rangeStart_(0),
+    rangeBlock_(false), cut_(false), endBit_(0), trailing_(false),
+    streamCrc_(0), crcKnown_(true),
+    finished_(false), output_(0), index_(false)
+  {}
+
+  // Access points met by close() are taken after Destroy().
+  ~ParallelBunzipImpl() {
+    ClearAccessPoints(accessPoints_);
+  }
+
+
+  // Options are threads, index, to report blocks as access points,
+  // accessPoint, to start decompression at, and endBit, position of block
+  // magic input is cut at.
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    small_ = 0;
+    threads_ = ParallelPool::DefaultThreads();
+    if (args.Length() > 0 && !args[0]->IsUndefined()) {
+      small_ = args[0]->BooleanValue() ? 1 : 0;
+    }
+    if (args.Length() < 2 || !args[1]->IsObject()) {
+      return Undefined();
+    }
+    if (!GetIntegerOption(args[1], "threads", 1, MaxThreads, threads_)) {
+      return Undefined();
+    }
+    Local<Object> options = args[1]->ToObject();
+    index_ = options->Get(String::NewSymbol("index"))->BooleanValue();
+    Local<Value> point = options->Get(String::NewSymbol("accessPoint"));
+    if (!point->IsUndefined()) {
+      StartAt(point);
+      COND_RETURN(!started_, Undefined());
+    }
+    return CutAt(options->Get(String::NewSymbol("endBit")));
+  }
+
+
+  // Expect input to end just after block magic at bit position value of
+  // original input, rather than at end of the last stream.
+  Handle<Value> CutAt(Handle<Value> value) {
+    // Offsets are passed as JS numbers, which are exact up to 2^53.
+    const double MaxOffset = 9007199254740992.0;
+
+    if (value->IsUndefined()) {
+      return Undefined();
+    }
+    double number = value->NumberValue();
+    if (!value->IsNumber() || number < 0 || number > MaxOffset ||
+        static_cast<double>(static_cast<uint64_t>(number)) != number ||
+        (started_ && static_cast<uint64_t>(number) <= rangeStart_)) {
+      Local<Value> exception = Exception::TypeError(String::New(
+            "endBit must be a bit offset following accessPoint"));
+      return ThrowException(exception);
+    }
+    cut_ = true;
+    endBit_ = static_cast<uint64_t>(number);
+    return Undefined();
+  }
+
+
+  // Start decompression at block, reported as access point by indexing
+  // ParallelBunzip. Input is expected to start at byte, which contains the
+  // block start. Combined CRC of the first stream is not checked, as it
+  // covers blocks preceding the point.
+  Handle<Value> StartAt(Handle<Value> value) {
+    uint64_t bit;
+    Local<Value> window;
+    if (!GetAccessPoint(value, 0, bit, output_, window)) {
+      return Undefined();
+    }
+    base_ = scanned_ = bit >> 3;
+    started_ = true;
+    rangeStart_ = bit;
+    rangeBlock_ = true;
+    crcKnown_ = false;
+    return Undefined();
+  }
+
+
+  int Write(char *data, int &dataLength, Blob &out) {
+    int ret = Drain(out, false);
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    while (dataLength > 0) {
+      if (jobs_.length() >= Backlog()) {
+        // Caller is ahead of decompression.
+        ret = Drain(out, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (jobs_.length() >= Backlog()) {
+          // Output is full.
+          break;
+        }
+      }
+
+      int length = dataLength < ScanChunk ? dataLength : ScanChunk;
+      ret = Scan(data, length);
+      COND_RETURN(Utils::IsError(ret), ret);
+      data += length;
+      dataLength -= length;
+    }
+    return Drain(out, false);
+  }
+
+
+  // Output of already decoded blocks. Geometric growth of output takes care
+  // of the rest.
+  size_t WriteSizeHint(int dataLength) {
+    return jobs_.ReadyLength();
+  }
+
+
+  size_t FinishSizeHint() {
+    size_t length = jobs_.ReadyLength();
+    for (size_t i = 0; i < jobs_.length(); ++i) {
+      Job *job = jobs_[i];
+      if (!ParallelPool::Done(job)) {
+        length += job->input_.length() * ExpectedRatio;
+      }
+    }
+    return length;
+  }
+
+
+  // Decompressor outputs as much as possible anyway, so flush does nothing,
+  // but mode is checked as for compressor.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
+    return BZ_OK;
+  }
+
+
+  int Finish(Blob &out) {
+    if (!finished_) {
+      finished_ = true;
+      COND_RETURN(!started_, BZ_UNEXPECTED_EOF);
+      // Input cut at block magic ends just past it, and the block is not
+      // needed. Otherwise the last range is decoded, so that truncated
+      // input is reported.
+      bool cut = cut_ && rangeBlock_ && rangeStart_ == endBit_ &&
+        scanned_ == (endBit_ + Job::MagicLength + 7) >> 3;
+      if (!cut && !trailing_) {
+        int ret = Submit(scanned_ * 8, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+    }
+
+    int ret = Drain(out, true);
+    COND_RETURN(Utils::IsError(ret), ret);
+    return jobs_.length() == 0 ? BZ_STREAM_END : BZ_OK;
+  }
+
+
+  // Streams are reported as members.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {
+    MoveBoundaries(boundaries_, boundaries);
+  }
+
+
+  // Blocks are reported as access points, which need no window.
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {
+    MoveAccessPoints(accessPoints_, points);
+  }
+
+
+  void Destroy() {
+    jobs_.Clear();
+    buffer_.Free();
+  }
+
+ private:
+  // Append input to buffer and look for magics in it. Range preceding each
+  // magic found is submitted for decoding.
+  int Scan(const char *data, int length) {
+    COND_RETURN(trailing_, BZ_OK);
+
+    // Drop input preceding current range.
+    size_t unused = (rangeStart_ >> 3) - base_;
+    if (unused > buffer_.length() / 2) {
+      memmove(buffer_.data(), buffer_.data() + unused,
+          buffer_.length() - unused);
+      buffer_.ResetLength();
+      buffer_.IncreaseLengthBy(scanned_ - base_ - unused);
+      base_ += unused;
+    }
+
+    COND_RETURN(!buffer_.Reserve(length), BZ_MEM_ERROR);
+    memcpy(buffer_.data() + buffer_.length(), data, length);
+    buffer_.IncreaseLengthBy(length);
+    COND_RETURN(!started_ && buffer_.length() >= Job::HeaderLength &&
+        !IsHeader(buffer_.data()), BZ_DATA_ERROR_MAGIC);
+
+    // Register holds last 64 bits of input, so all 8 bit alignments of magic
+    // are checked once per byte.
+    const unsigned char *bytes =
+      reinterpret_cast<const unsigned char*>(data);
+    for (int i = 0; i < length; ++i) {
+      register_ = (register_ << 8) | bytes[i];
+      ++scanned_;
+      if (scanned_ < 6) {
+        continue;
+      }
+      for (int shift = 7; shift >= 0; --shift) {
+        uint64_t value = (register_ >> shift) & MagicMask;
+        if (value != Job::BlockMagic && value != Job::EosMagic) {
+          continue;
+        }
+        uint64_t end = scanned_ * 8 - shift;
+        if (end < static_cast<uint64_t>(Job::MagicLength)) {
+          continue;
+        }
+        int ret = Magic(end - Job::MagicLength, value == Job::BlockMagic);
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+
+      // Data following stream trailer, which does not start as stream
+      // header, ends input, as Bunzip ignores it.
+      if (started_ && !rangeBlock_ &&
+          scanned_ == TrailerEnd() + Job::HeaderLength &&
+          !IsHeader(buffer_.data() + (TrailerEnd() - base_))) {
+        trailing_ = true;
+        return Submit(TrailerEnd() * 8, true);
+      }
+    }
+
+    COND_RETURN(started_ && scanned_ - (rangeStart_ >> 3) > MaxRangeLength,
+        BZ_DATA_ERROR);
+    return BZ_OK;
+  }
+
+
+  // Handle magic starting at bit position of input.
+  int Magic(uint64_t position, bool block) {
+    if (!started_) {
+      // Input must start with stream header.
+      COND_RETURN(position != Job::HeaderLength * 8 ||
+          !IsHeader(buffer_.data()), BZ_DATA_ERROR_MAGIC);
+      started_ = true;
+    } else {
+      // Magics preceding access point, if decompression starts at one, are
+      // not of interest.
+      COND_RETURN(position <= rangeStart_, BZ_OK);
+      int ret = Submit(position, false);
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    rangeStart_ = position;
+    rangeBlock_ = block;
+    return BZ_OK;
+  }
+
+
+  // Submit current range, which ends at bit position of input.
+  int Submit(uint64_t end, bool last) {
+    Job *job = new(std::nothrow) Job(rangeBlock_, small_);
+    COND_RETURN(job == 0, BZ_MEM_ERROR);
+
+    size_t first = rangeStart_ >> 3;
+    size_t length = ((end + 7) >> 3) - first;
+    if (!job->input_.GrowBy(length)) {
+      delete job;
+      return BZ_MEM_ERROR;
+    }
+    memcpy(job->input_.data(), buffer_.data() + first - base_, length);
+    job->input_.IncreaseLengthBy(length);
+    job->position_ = first;
+    job->bitOffset_ = rangeStart_ & 7;
+    job->bitLength_ = end - rangeStart_;
+    job->last_ = last;
+
+    COND_RETURN(!jobs_.Push(job, threads_), BZ_MEM_ERROR);
+    return BZ_OK;
+  }
+
+
+  // Pass output of decoded blocks in order, while output space is
+  // available. If wait is true, wait for blocks being decoded, so that
+  // output size hints account for them.
+  int Drain(Blob &out, bool wait) {
+    while (jobs_.FrontDone(wait)) {
+      Job *job = jobs_.Front();
+      if (Utils::IsError(job->status())) {
+        if (jobs_.length() == 1 && !finished_) {
+          // Wait for the next range.
+          break;
+        }
+        Job *next = jobs_.length() > 1 ? jobs_[1] : 0;
+        if (next == 0 || (!next->block_ && CheckTrailer(next) == BZ_OK) ||
+            job->input_.length() > MaxRangeLength) {
+          // Block is either truncated or corrupted.
+          return job->last_ && !job->merged_ ?
+            BZ_UNEXPECTED_EOF : BZ_DATA_ERROR;
+        }
+
+        // Block might end with false magic.
+        Job *merged = job->Merge(next);
+        COND_RETURN(merged == 0, BZ_MEM_ERROR);
+        delete jobs_.Pop();
+        jobs_.ReplaceFront(merged, threads_);
+        continue;
+      }
+
+      if (job->block_) {
+        if (!jobs_.CopyFront(out)) {
+          break;
+        }
+        streamCrc_ = ((streamCrc_ << 1) | (streamCrc_ >> 31)) ^ job->crc();
+        if (index_) {
+          int ret = AddAccessPoint(job);
+          COND_RETURN(Utils::IsError(ret), ret);
+        }
+        output_ += job->output_.length();
+      } else {
+        int ret = CheckTrailer(job);
+        COND_RETURN(Utils::IsError(ret), ret);
+        COND_RETURN(crcKnown_ && job->crc() != streamCrc_, BZ_DATA_ERROR);
+        streamCrc_ = 0;
+        crcKnown_ = true;
+
+        // Stream ends with padding of trailer to byte boundary.
+        MemberBoundary boundary = { job->position_ +
+          ((job->bitOffset_ + Job::MagicLength + 32 + 7) >> 3), output_ };
+        COND_RETURN(!boundaries_.Push(boundary), BZ_MEM_ERROR);
+      }
+      delete jobs_.Pop();
+    }
+    return BZ_OK;
+  }
+
+
+  int AddAccessPoint(Job *job) {
+    AccessPoint *point = new(std::nothrow) AccessPoint();
+    COND_RETURN(point == 0, BZ_MEM_ERROR);
+    point->input = job->position_ * 8 + job->bitOffset_;
+    point->output = output_;
+    if (!accessPoints_.Push(point)) {
+      delete point;
+      return BZ_MEM_ERROR;
+    }
+    return BZ_OK;
+  }
+
+
+  // Stream trailer is followed either by end of input, or by header of next
+  // stream, which precedes next magic. The last trailer might be followed
+  // by data, which is not a stream, and is ignored.
+  int CheckTrailer(Job *job) {
+    COND_RETURN(!job->complete(), BZ_UNEXPECTED_EOF);
+
+    size_t end = (job->bitOffset_ + job->bitLength_) >> 3;
+    size_t trailer = (job->bitOffset_ + Job::MagicLength + 32 + 7) >> 3;
+    if (job->last_) {
+      COND_RETURN(end < trailer, BZ_UNEXPECTED_EOF);
+      // Input ending with a stream header, or a part of it, is truncated.
+      COND_RETURN(end > trailer && StartsHeader(job->input_.data() + trailer,
+            end - trailer), BZ_UNEXPECTED_EOF);
+    } else {
+      COND_RETURN(end != trailer + Job::HeaderLength ||
+          !IsHeader(job->input_.data() + trailer), BZ_DATA_ERROR_MAGIC);
+    }
+    return BZ_OK;
+  }
+
+
+  static bool IsHeader(const char *data) {
+    return memcmp(data, "BZh", 3) == 0 && data[3] >= '1' && data[3] <= '9';
+  }
+
+
+  // Whether length bytes of data are stream header or start of one.
+  static bool StartsHeader(const char *data, size_t length) {
+    if (length >= Job::HeaderLength) {
+      return IsHeader(data);
+    }
+    return memcmp(data, "BZh", length) == 0;
+  }
+
+
+  // Input byte following trailer of stream, which current range ends.
+  uint64_t TrailerEnd() const {
+    return (rangeStart_ + Job::MagicLength + 32 + 7) >> 3;
+  }
+
+
+  // Maximum number of blocks queued for decoding or waiting for output.
+  size_t Backlog() const {
+    return 2 * threads_;
+  }
+
+ private:
+  static const uint64_t MagicMask = (1ULL << 48) - 1;
+
+  int small_;
+  int threads_;
+
+  // Input starting at byte base_, which is not yet submitted for decoding.
+  Blob buffer_;
+  size_t base_;
+
+  // Number of input bytes scanned, and last bytes of them.
+  uint64_t scanned_;
+  uint64_t register_;
+
+  // Whether first magic is found, bit position of the last one and its
+  // kind.
+  bool started_;
+  uint64_t rangeStart_;
+  bool rangeBlock_;
+
+  // Whether input is cut at block magic, and its bit position.
+  bool cut_;
+  uint64_t endBit_;
+
+  // Whether input following the last stream is found to be not a stream,
+  // and is ignored.
+  bool trailing_;
+
+  // Combined CRC of blocks of current stream, and whether it covers all of
+  // them.
+  uint32_t streamCrc_;
+  bool crcKnown_;
+
+  bool finished_;
+
+  // Ranges being decoded or waiting for output, in order.
+  ParallelQueue<Job> jobs_;
+
+  // Output passed so far, ends of streams and blocks not yet taken, and
+  // whether blocks are reported.
+  uint64_t output_;
+  Queue<MemberBoundary> boundaries_;
+  bool index_;
+  Queue<AccessPoint*> accessPoints_;
+};
+const char ParallelBunzipImpl::Name[] = "ParallelBunzip";
+typedef ZipLib<ParallelBunzipImpl> ParallelBunzip;
@@ -31,6 +31,10 @@
 #include "bzip.cc"
 #endif
 
+#ifdef WITH_GZIP
+#include "auto.cc"
+#endif
+
 extern "C" void
 init (Handle<Object> target) 
 {
@@ -39,11 +43,26 @@ init (Handle<Object> target)
 #ifdef WITH_GZIP
   Gzip::Initialize(target);
   Gunzip::Initialize(target);
+  Deflate::Initialize(target);
+  Inflate::Initialize(target);
+  DeflateRaw::Initialize(target);
+  InflateRaw::Initialize(target);
+  ParallelGzip::Initialize(target);
+  ParallelGunzip::Initialize(target);
+  Bgzf::Initialize(target);
+  Dictionary::Initialize(target);
+  DictionaryTrainer::Initialize(target);
 #endif
 
 #ifdef WITH_BZIP
   Bzip::Initialize(target);
   Bunzip::Initialize(target);
+  ParallelBzip::Initialize(target);
+  ParallelBunzip::Initialize(target);
+#endif
+
+#ifdef WITH_GZIP
+  AutoDecompress::Initialize(target);
 #endif
 }
 
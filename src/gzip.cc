@@ -30,6 +30,7 @@
 #include <zlib.h>
 
 #include "utils.h"
+#include "parallel.h"
 #include "zlib.h"
 
 using namespace v8;
@@ -91,6 +92,80 @@ class GzipUtils {
     }
   }
 
+
+  // Flush mode of flush(): 'sync', the default, or 'full'. Returns false,
+  // if mode is unknown.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    if (value.IsEmpty() || value->IsUndefined()) {
+      mode = Z_SYNC_FLUSH;
+      return true;
+    }
+    String::AsciiValue name(value);
+    if (strcmp(*name, "sync") == 0) {
+      mode = Z_SYNC_FLUSH;
+    } else if (strcmp(*name, "full") == 0) {
+      mode = Z_FULL_FLUSH;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+
+  // Container of deflate stream.
+  enum Format {
+    FormatGzip,
+    FormatZlib,
+    FormatRaw
+  };
+
+
+  // Read strategy field of options object, one of 'default', 'filtered',
+  // 'huffman', 'rle' and 'fixed', into strategy, unless field is undefined.
+  // Throws TypeError and returns false, if strategy is unknown.
+  static bool GetStrategyOption(Handle<Value> options, int &strategy) {
+    if (options.IsEmpty() || !options->IsObject()) {
+      return true;
+    }
+    Local<Value> field =
+        options->ToObject()->Get(String::NewSymbol("strategy"));
+    if (field->IsUndefined()) {
+      return true;
+    }
+    String::AsciiValue name(field);
+    if (strcmp(*name, "default") == 0) {
+      strategy = Z_DEFAULT_STRATEGY;
+    } else if (strcmp(*name, "filtered") == 0) {
+      strategy = Z_FILTERED;
+    } else if (strcmp(*name, "huffman") == 0) {
+      strategy = Z_HUFFMAN_ONLY;
+    } else if (strcmp(*name, "rle") == 0) {
+      strategy = Z_RLE;
+    } else if (strcmp(*name, "fixed") == 0) {
+      strategy = Z_FIXED;
+    } else {
+      ThrowException(Exception::TypeError(String::New(
+              "strategy must be one of 'default', 'filtered', 'huffman', "
+              "'rle' and 'fixed'")));
+      return false;
+    }
+    return true;
+  }
+
+
+  // windowBits of deflateInit2() and inflateInit2() for format and window
+  // of 2^bits bytes.
+  static int WindowBits(Format format, int bits = MAX_WBITS) {
+    switch (format) {
+      case FormatZlib:
+        return bits;
+      case FormatRaw:
+        return -bits;
+      default:
+        return 16 + bits;
+    }
+  }
+
  private:
   static const char NeedDictionary[];
   static const char Errno[];
@@ -100,8 +175,8 @@ class GzipUtils {
   static const char BufError[];
   static const char VersionError[];
 };
-const char GzipUtils::NeedDictionary[] = "Dictionary must be specified. "
-  "Currently this is unsupported by library.";
+const char GzipUtils::NeedDictionary[] = "Z_NEED_DICT: Input needs preset "
+  "dictionary, which is not given or does not match.";
 const char GzipUtils::Errno[] = "Z_ERRNO: Input/output error.";
 const char GzipUtils::StreamError[] = "Z_STREAM_ERROR: Invalid arguments or "
   "stream state is inconsistent.";
@@ -112,8 +187,542 @@ const char GzipUtils::VersionError[] = "Z_VERSION_ERROR: "
   "Invalid library version.";
 
 
-class GzipImpl {
-  friend class ZipLib<GzipImpl>;
+// Preset dictionary, shared by any number of Gzip and Gunzip objects. Data
+// are copied, and Adler-32 checksum, by which zlib stream refers to
+// dictionary, is computed once, when dictionary is made. Users keep
+// reference to dictionary, so it outlives them regardless of JS object.
+class Dictionary : public ObjectWrap {
+ public:
+  static void Initialize(Handle<Object> target) {
+    HandleScope scope;
+
+    constructor_ = Persistent<FunctionTemplate>::New(
+        FunctionTemplate::New(New));
+    constructor_->InstanceTemplate()->SetInternalFieldCount(1);
+
+    target->Set(String::NewSymbol("Dictionary"),
+        constructor_->GetFunction());
+  }
+
+
+  static Handle<Value> New(const Arguments &args) {
+    HandleScope scope;
+
+    if (!Buffer::HasInstance(args[0])) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("Dictionary must be of type Buffer"));
+      return ThrowException(exception);
+    }
+    Local<Object> buffer = args[0]->ToObject();
+    size_t length = Buffer::Length(buffer);
+
+    Dictionary *result = new(std::nothrow) Dictionary();
+    // Data are never null, even if empty, as zlib does not take null
+    // dictionary.
+    if (result == 0 || !result->data_.GrowBy(length != 0 ? length : 1)) {
+      delete result;
+      return ThrowException(GzipUtils::GetException(Z_MEM_ERROR));
+    }
+    memcpy(result->data_.data(), Buffer::Data(buffer), length);
+    result->data_.IncreaseLengthBy(length);
+    result->id_ = adler32(adler32(0, Z_NULL, 0), result->data_.data(),
+        length);
+    result->Wrap(args.This());
+
+    args.This()->Set(String::NewSymbol("id"),
+        Number::New(static_cast<double>(result->id_)));
+    args.This()->Set(String::NewSymbol("length"),
+        Integer::NewFromUnsigned(length));
+    return args.This();
+  }
+
+
+  // Make Dictionary object of length bytes of data.
+  static Local<Value> NewInstance(const char *data, size_t length) {
+    HandleScope scope;
+
+    Local<Value> argv[1];
+    argv[0] = Local<Value>::New(Buffer::New(const_cast<char*>(data),
+          length)->handle_);
+    return scope.Close(constructor_->GetFunction()->NewInstance(1, argv));
+  }
+
+
+  // Read dictionary field of options object into dictionary, and acquire
+  // it, unless field is undefined. Throws TypeError and returns false, if
+  // field is not a Dictionary.
+  static bool GetOption(Handle<Value> options, Dictionary *&dictionary) {
+    if (options.IsEmpty() || !options->IsObject()) {
+      return true;
+    }
+    Local<Value> field =
+      options->ToObject()->Get(String::NewSymbol("dictionary"));
+    if (field->IsUndefined()) {
+      return true;
+    }
+    if (!field->IsObject() || !constructor_->HasInstance(field)) {
+      ThrowException(Exception::TypeError(
+            String::New("dictionary must be a Dictionary")));
+      return false;
+    }
+    dictionary = ObjectWrap::Unwrap<Dictionary>(field->ToObject());
+    dictionary->Ref();
+    return true;
+  }
+
+
+  // Let go dictionary acquired by GetOption(). Called in V8 thread only,
+  // while data are read by any thread.
+  void Release() {
+    Unref();
+  }
+
+
+  const Bytef* data() const {
+    return data_.data();
+  }
+
+
+  uInt length() const {
+    return data_.length();
+  }
+
+
+  uLong id() const {
+    return id_;
+  }
+
+ private:
+  Dictionary()
+    : id_(0)
+  {}
+
+ private:
+  static Persistent<FunctionTemplate> constructor_;
+
+  GzipUtils::Blob data_;
+  uLong id_;
+};
+Persistent<FunctionTemplate> Dictionary::constructor_;
+
+
+// Builds Dictionary of sample inputs in eio thread, as zstd COVER algorithm
+// does. Corpus of samples is split into epochs, one per segment of
+// dictionary, and segment of each epoch, which substrings occur in most
+// samples, is picked until dictionary is full. Substrings of picked
+// segments are not counted again, and the best segments are put at
+// dictionary end, closest to data. Gain is measured by deflating each
+// sample with and without dictionary.
+class DictionaryTrainer {
+ public:
+  static void Initialize(Handle<Object> target) {
+    NODE_SET_METHOD(target, "trainDictionary", Train);
+  }
+
+
+  // trainDictionary(samples, size, callback) calls back with error,
+  // Dictionary and object with inputLength, plainLength, trainedLength,
+  // i.e. total length of samples and of their deflated data without and
+  // with dictionary, and gain, which is ratio of the latter two.
+  static Handle<Value> Train(const Arguments &args) {
+    HandleScope scope;
+
+    if (!args[0]->IsArray()) {
+      return ThrowSamplesExpected();
+    }
+    Local<Array> samples = Local<Array>::Cast(args[0]);
+    for (uint32_t i = 0; i < samples->Length(); ++i) {
+      if (!Buffer::HasInstance(samples->Get(i))) {
+        return ThrowSamplesExpected();
+      }
+    }
+    if (!args[1]->IsInt32() || args[1]->Int32Value() < 1 ||
+        args[1]->Int32Value() > MaxLength) {
+      char message[64];
+      snprintf(message, sizeof(message),
+          "size must be an integer in range [1, %d]", MaxLength);
+      return ThrowException(Exception::TypeError(String::New(message)));
+    }
+    if (!args[2]->IsFunction()) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("Callback must be a function"));
+      return ThrowException(exception);
+    }
+
+    DictionaryTrainer *trainer = new(std::nothrow) DictionaryTrainer(
+        samples->Length(), args[1]->Int32Value(),
+        Local<Function>::Cast(args[2]));
+    if (trainer == 0 || trainer->samples_ == 0) {
+      delete trainer;
+      return ThrowException(GzipUtils::GetException(Z_MEM_ERROR));
+    }
+    for (uint32_t i = 0; i < samples->Length(); ++i) {
+      trainer->samples_[i].Set(samples->Get(i));
+    }
+
+    ev_ref(EV_DEFAULT_UC);
+    eio_custom(DoTrain, EIO_PRI_DEFAULT, AfterTrain, trainer);
+    return Undefined();
+  }
+
+ private:
+  // Input Buffer, which is kept alive until training ends.
+  struct Sample {
+    Sample()
+      : data(0), length(0)
+    {}
+
+    ~Sample() {
+      if (!buffer.IsEmpty()) {
+        buffer.Dispose();
+      }
+    }
+
+    void Set(Local<Value> value) {
+      buffer = Persistent<Value>::New(value);
+      data = reinterpret_cast<Bytef*>(Buffer::Data(value->ToObject()));
+      length = Buffer::Length(value->ToObject());
+    }
+
+    Persistent<Value> buffer;
+    const Bytef *data;
+    size_t length;
+  };
+
+
+  struct Segment {
+    const Bytef *data;
+    size_t length;
+    uint64_t score;
+
+    // Offset in corpus, which breaks ties of score.
+    uint64_t position;
+  };
+
+ private:
+  DictionaryTrainer(uint32_t count, int size, Local<Function> callback)
+    : samples_(new(std::nothrow) Sample[count]), count_(count), size_(size),
+    callback_(Persistent<Function>::New(callback)), counts_(0),
+    lastSample_(0), status_(Z_OK), inputLength_(0), plainLength_(0),
+    trainedLength_(0)
+  {}
+
+  ~DictionaryTrainer() {
+    delete[] samples_;
+    delete[] counts_;
+    delete[] lastSample_;
+    callback_.Dispose();
+  }
+
+
+  // Executed in worker thread.
+  static int DoTrain(eio_req *req) {
+    DictionaryTrainer *self = reinterpret_cast<DictionaryTrainer*>(req->data);
+    self->status_ = self->Build();
+    if (!GzipUtils::IsError(self->status_)) {
+      self->status_ = self->Measure();
+    }
+    return 0;
+  }
+
+
+  // Executed in V8 thread.
+  static int AfterTrain(eio_req *req) {
+    HandleScope scope;
+
+    DictionaryTrainer *self = reinterpret_cast<DictionaryTrainer*>(req->data);
+    ev_unref(EV_DEFAULT_UC);
+
+    Local<Value> argv[3];
+    argv[0] = GzipUtils::GetException(self->status_);
+    int argc = 1;
+    if (!GzipUtils::IsError(self->status_)) {
+      argv[1] = Dictionary::NewInstance(
+          reinterpret_cast<const char*>(self->dictionary_.data()),
+          self->dictionary_.length());
+
+      Local<Object> stats = Object::New();
+      stats->Set(String::NewSymbol("inputLength"),
+          Number::New(static_cast<double>(self->inputLength_)));
+      stats->Set(String::NewSymbol("plainLength"),
+          Number::New(static_cast<double>(self->plainLength_)));
+      stats->Set(String::NewSymbol("trainedLength"),
+          Number::New(static_cast<double>(self->trainedLength_)));
+      stats->Set(String::NewSymbol("gain"),
+          Number::New(self->trainedLength_ == 0 ? 1 :
+            static_cast<double>(self->plainLength_) / self->trainedLength_));
+      argv[2] = stats;
+      argc = 3;
+    }
+
+    TryCatch try_catch;
+
+    self->callback_->Call(Context::GetCurrent()->Global(), argc, argv);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+    delete self;
+    return 0;
+  }
+
+
+  int Build() {
+    counts_ = new(std::nothrow) uint32_t[HashSize];
+    lastSample_ = new(std::nothrow) uint32_t[HashSize];
+    COND_RETURN(counts_ == 0 || lastSample_ == 0, Z_MEM_ERROR);
+    memset(counts_, 0, HashSize * sizeof(counts_[0]));
+    memset(lastSample_, 0, HashSize * sizeof(lastSample_[0]));
+
+    // Substrings are counted once per sample they occur in.
+    for (uint32_t i = 0; i < count_; ++i) {
+      const Sample &sample = samples_[i];
+      inputLength_ += sample.length;
+      for (size_t j = 0; j + DmerLength <= sample.length; ++j) {
+        uint32_t hash = Hash(sample.data + j);
+        if (lastSample_[hash] != i + 1) {
+          lastSample_[hash] = i + 1;
+          ++counts_[hash];
+        }
+      }
+    }
+
+    // Segment shorter than substring would score nothing, so it is cut
+    // later.
+    size_t segmentLength = size_ < SegmentLength ? size_ : SegmentLength;
+    if (segmentLength < DmerLength) {
+      segmentLength = DmerLength;
+    }
+    size_t epochs = (size_ + segmentLength - 1) / segmentLength;
+    size_t epochLength = inputLength_ / epochs;
+    if (epochLength < segmentLength) {
+      epochLength = segmentLength;
+    }
+
+    // Segments are shorter than SegmentLength in short samples, so epochs
+    // are passed until dictionary is full, or nothing is worth picking.
+    ScopedOutputBuffer<Segment> segments;
+    size_t length = 0;
+    bool picked = true;
+    while (length < size_ && picked) {
+      picked = false;
+      for (size_t begin = 0; begin < inputLength_ && length < size_;
+          begin += epochLength) {
+        Segment best = { 0, 0, 0, 0 };
+        PickSegment(begin, begin + epochLength, segmentLength, best);
+        if (best.score == 0) {
+          continue;
+        }
+        COND_RETURN(!segments.Reserve(1), Z_MEM_ERROR);
+        segments.data()[segments.length()] = best;
+        segments.IncreaseLengthBy(1);
+        length += best.length;
+        picked = true;
+      }
+    }
+
+    // Sort is stable for equal scores, as ties are broken by position. The
+    // worst segments are dropped, or cut, to fit size.
+    if (segments.length() != 0) {
+      qsort(segments.data(), segments.length(), sizeof(Segment),
+          CompareSegments);
+    }
+    size_t first = 0;
+    while (length > size_) {
+      Segment &segment = segments.data()[first];
+      size_t excess = length - size_;
+      if (excess >= segment.length) {
+        length -= segment.length;
+        ++first;
+      } else {
+        segment.data += excess;
+        segment.length -= excess;
+        length -= excess;
+      }
+    }
+    COND_RETURN(!dictionary_.GrowBy(length), Z_MEM_ERROR);
+    for (size_t i = first; i < segments.length(); ++i) {
+      const Segment &segment = segments.data()[i];
+      memcpy(dictionary_.data() + dictionary_.length(), segment.data,
+          segment.length);
+      dictionary_.IncreaseLengthBy(segment.length);
+    }
+    return Z_OK;
+  }
+
+
+  // Find segment of samples' data in range [begin, end) of corpus, at most
+  // maxLength bytes long, whose substrings occur in most samples, and stop
+  // counting them.
+  void PickSegment(size_t begin, size_t end, size_t maxLength,
+      Segment &best) {
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count_; offset += samples_[i++].length) {
+      const Sample &sample = samples_[i];
+      if (offset + sample.length <= begin || offset >= end) {
+        continue;
+      }
+      size_t from = begin > offset ? begin - offset : 0;
+      size_t to = end - offset < sample.length ? end - offset : sample.length;
+      size_t length = to - from < maxLength ? to - from : maxLength;
+      if (length < DmerLength) {
+        continue;
+      }
+
+      // Sliding sum of substring scores over segments starting in
+      // [from, to - length].
+      size_t dmers = length - DmerLength + 1;
+      uint64_t score = 0;
+      for (size_t j = 0; j < dmers; ++j) {
+        score += Score(sample.data + from + j);
+      }
+      for (size_t j = from; ; ++j) {
+        if (score > best.score) {
+          best.data = sample.data + j;
+          best.length = length;
+          best.score = score;
+          best.position = offset + j;
+        }
+        if (j + length >= to) {
+          break;
+        }
+        score -= Score(sample.data + j);
+        score += Score(sample.data + j + dmers);
+      }
+    }
+
+    for (size_t j = 0; best.score != 0 && j + DmerLength <= best.length;
+        ++j) {
+      counts_[Hash(best.data + j)] = 0;
+    }
+  }
+
+
+  // Substring occurring in single sample only is not worth keeping, as
+  // deflate finds it anyway.
+  uint32_t Score(const Bytef *data) const {
+    uint32_t count = counts_[Hash(data)];
+    return count > 1 ? count - 1 : 0;
+  }
+
+
+  static uint32_t Hash(const Bytef *data) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < DmerLength; ++i) {
+      value = (value << 8) | data[i];
+    }
+    return static_cast<uint32_t>(
+        (value * 0x9E3779B97F4A7C15ULL) >> (64 - HashBits));
+  }
+
+
+  static int CompareSegments(const void *a, const void *b) {
+    const Segment *x = reinterpret_cast<const Segment*>(a);
+    const Segment *y = reinterpret_cast<const Segment*>(b);
+    if (x->score != y->score) {
+      return x->score < y->score ? -1 : 1;
+    }
+    return x->position < y->position ? -1 :
+      (x->position > y->position ? 1 : 0);
+  }
+
+
+  // Deflate each sample with and without dictionary.
+  int Measure() {
+    z_stream plain, trained;
+    memset(&plain, 0, sizeof(plain));
+    memset(&trained, 0, sizeof(trained));
+    int ret = deflateInit2(&plain, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+        -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    COND_RETURN(GzipUtils::IsError(ret), ret);
+    ret = deflateInit2(&trained, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+        -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (GzipUtils::IsError(ret)) {
+      deflateEnd(&plain);
+      return ret;
+    }
+
+    GzipUtils::Blob out;
+    for (uint32_t i = 0; i < count_ && !GzipUtils::IsError(ret); ++i) {
+      const Sample &sample = samples_[i];
+      out.ResetLength();
+      if (!out.Reserve(deflateBound(&plain, sample.length))) {
+        ret = Z_MEM_ERROR;
+        break;
+      }
+      ret = Deflate(plain, sample, out, plainLength_);
+      if (!GzipUtils::IsError(ret) && dictionary_.length() != 0) {
+        ret = deflateSetDictionary(&trained, dictionary_.data(),
+            dictionary_.length());
+      }
+      if (!GzipUtils::IsError(ret)) {
+        ret = Deflate(trained, sample, out, trainedLength_);
+      }
+    }
+    deflateEnd(&plain);
+    deflateEnd(&trained);
+    return ret;
+  }
+
+
+  // Deflate sample into out, which fits deflateBound() of it, and reset
+  // stream for the next one.
+  static int Deflate(z_stream &stream, const Sample &sample,
+      GzipUtils::Blob &out, uint64_t &total) {
+    stream.next_in = const_cast<Bytef*>(sample.data);
+    stream.avail_in = sample.length;
+    stream.next_out = out.data();
+    stream.avail_out = out.avail();
+    int ret = deflate(&stream, Z_FINISH);
+    COND_RETURN(ret != Z_STREAM_END, ret == Z_OK ? Z_BUF_ERROR : ret);
+    total += stream.total_out;
+    return deflateReset(&stream);
+  }
+
+
+  static Handle<Value> ThrowSamplesExpected() {
+    Local<Value> exception = Exception::TypeError(
+        String::New("samples must be an Array of Buffers"));
+    return ThrowException(exception);
+  }
+
+ private:
+  // Dictionary beyond deflate window is of no use.
+  static const int MaxLength = 1 << MAX_WBITS;
+
+  // Substrings counted are DmerLength bytes long, dictionary is made of
+  // SegmentLength byte segments.
+  static const size_t DmerLength = 8;
+  static const size_t SegmentLength = 256;
+
+  static const int HashBits = 20;
+  static const size_t HashSize = 1 << HashBits;
+
+  Sample *samples_;
+  uint32_t count_;
+  size_t size_;
+  Persistent<Function> callback_;
+
+  // Number of samples each substring hash occurs in, and last sample it
+  // was counted for, plus one.
+  uint32_t *counts_;
+  uint32_t *lastSample_;
+
+  GzipUtils::Blob dictionary_;
+  int status_;
+  uint64_t inputLength_;
+  uint64_t plainLength_;
+  uint64_t trainedLength_;
+};
+
+
+// Deflate compressor. Gzip, Deflate and DeflateRaw write gzip, zlib and raw
+// deflate formats respectively.
+template <GzipUtils::Format DefaultFormat>
+class DeflateImpl {
+  friend class ZipLib<DeflateImpl>;
+  friend class ParallelGzipImpl;
+  friend class BgzfImpl;
 
   typedef GzipUtils Utils;
   typedef GzipUtils::Blob Blob;
@@ -121,8 +730,28 @@ class GzipImpl {
  private:
   static const char Name[];
 
+  // Writes estimated to be cheap may be processed in V8 thread.
+  static const bool InlineWrites = true;
+
+  // Smallest window deflate is known to handle in every format. zlib turns
+  // 8 into 9 for zlib format, and refuses it for raw one.
+  static const int MinWindowBits = 9;
+
  private:
-  Handle<Value> Init(const Arguments &args) {
+  DeflateImpl()
+    : pendingLimit_(0), dictionary_(0)
+  {}
+
+  ~DeflateImpl() {
+    if (dictionary_ != 0) {
+      dictionary_->Release();
+    }
+  }
+
+
+  // Options are dictionary to compress with, which is not supported by
+  // gzip format, and windowBits, memLevel and strategy of deflateInit2().
+  Handle<Value> Init(const ArgumentsView &args) {
     HandleScope scope;
 
     int level = Z_DEFAULT_COMPRESSION;
@@ -135,15 +764,44 @@ class GzipImpl {
       level = args[0]->Int32Value();
     }
 
+    int windowBits = MAX_WBITS;
+    int memLevel = 8;
+    int strategy = Z_DEFAULT_STRATEGY;
+    if (args.Length() > 1) {
+      if (!GetIntegerOption(args[1], "windowBits", MinWindowBits, MAX_WBITS,
+            windowBits) ||
+          !GetIntegerOption(args[1], "memLevel", 1, MAX_MEM_LEVEL,
+            memLevel) ||
+          !Utils::GetStrategyOption(args[1], strategy) ||
+          !Dictionary::GetOption(args[1], dictionary_)) {
+        return Undefined();
+      }
+    }
+    if (dictionary_ != 0 && DefaultFormat == Utils::FormatGzip) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("dictionary is not supported by gzip format"));
+      return ThrowException(exception);
+    }
+
     stream_.zalloc = Z_NULL;
     stream_.zfree = Z_NULL;
     stream_.opaque = Z_NULL;
 
-    int ret = deflateInit2(&stream_, level,
-                           Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    int ret = deflateInit2(&stream_, level, Z_DEFLATED,
+                           Utils::WindowBits(DefaultFormat, windowBits),
+                           memLevel, strategy);
     if (Utils::IsError(ret)) {
       return ThrowException(Utils::GetException(ret));
     }
+    // Size of deflate pending buffer.
+    pendingLimit_ = 4 << (memLevel + 6);
+    if (dictionary_ != 0) {
+      ret = deflateSetDictionary(&stream_, dictionary_->data(),
+          dictionary_->length());
+      if (Utils::IsError(ret)) {
+        return ThrowException(Utils::GetException(ret));
+      }
+    }
     return Undefined();
   }
 
@@ -156,6 +814,10 @@ class GzipImpl {
 
     int ret = deflate(&stream_, Z_NO_FLUSH);
     dataLength = stream_.avail_in;
+    if (ret == Z_BUF_ERROR) {
+      // No progress possible, i.e. no input and no pending output.
+      ret = Z_OK;
+    }
     if (!Utils::IsError(ret)) {
       out.IncreaseLengthBy(initAvail - stream_.avail_out);
     }
@@ -163,6 +825,56 @@ class GzipImpl {
   }
 
 
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
+    stream_.avail_in = 0;
+    stream_.next_in = NULL;
+    stream_.next_out = out.data() + out.length();
+    size_t initAvail = stream_.avail_out = out.avail();
+
+    int ret = deflate(&stream_, mode);
+    if (ret == Z_BUF_ERROR) {
+      // Nothing to flush.
+      ret = Z_OK;
+    }
+    if (!Utils::IsError(ret)) {
+      out.IncreaseLengthBy(initAvail - stream_.avail_out);
+    }
+    return ret;
+  }
+
+
+  // Upper bound of output for dataLength more bytes of input. Output so far
+  // cannot exceed deflateBound() of input so far, unless stream was flushed,
+  // and output is allocated at once. For long streams, deflateBound() of
+  // whole input is too pessimistic, so output is bounded by data held by
+  // deflate plus bound for new input.
+  size_t WriteSizeHint(int dataLength) {
+    return Bound(stream_.total_in + dataLength,
+        deflateBound(&stream_, dataLength) + pendingLimit_);
+  }
+
+
+  size_t FinishSizeHint() {
+    return Bound(stream_.total_in,
+        deflateBound(&stream_, 0) + pendingLimit_);
+  }
+
+
+  size_t Bound(uLong totalIn, size_t limit) {
+    uLong bound = deflateBound(&stream_, totalIn);
+    if (bound <= stream_.total_out || bound - stream_.total_out > limit) {
+      // Either bound is smaller, or counters have wrapped around.
+      return limit;
+    }
+    return bound - stream_.total_out;
+  }
+
+
   int Finish(Blob &out) {
     stream_.avail_in = 0;
     stream_.next_in = NULL;
@@ -177,19 +889,42 @@ class GzipImpl {
   }
 
 
+  // Compressor input is not split into members, nor indexed.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {}
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
   void Destroy() {
     deflateEnd(&stream_);
   }
 
  private:
   z_stream stream_;
+
+  // Upper bound of compressed data held by deflate between calls.
+  size_t pendingLimit_;
+
+  Dictionary *dictionary_;
 };
-const char GzipImpl::Name[] = "Gzip";
+typedef DeflateImpl<GzipUtils::FormatGzip> GzipImpl;
+typedef DeflateImpl<GzipUtils::FormatZlib> ZlibDeflateImpl;
+typedef DeflateImpl<GzipUtils::FormatRaw> RawDeflateImpl;
+template <> const char GzipImpl::Name[] = "Gzip";
+template <> const char ZlibDeflateImpl::Name[] = "Deflate";
+template <> const char RawDeflateImpl::Name[] = "DeflateRaw";
 typedef ZipLib<GzipImpl> Gzip;
+typedef ZipLib<ZlibDeflateImpl> Deflate;
+typedef ZipLib<RawDeflateImpl> DeflateRaw;
 
 
-class GunzipImpl {
-  friend class ZipLib<GunzipImpl>;
+// Deflate decompressor. Gunzip, Inflate and InflateRaw read gzip, zlib and
+// raw deflate formats respectively.
+template <GzipUtils::Format DefaultFormat>
+class InflateImpl {
+  friend class ZipLib<InflateImpl>;
+  friend class AutoDecompressImpl;
 
   typedef GzipUtils Utils;
   typedef GzipUtils::Blob Blob;
@@ -197,49 +932,1680 @@ class GunzipImpl {
  private:
   static const char Name[];
 
+  static const bool InlineWrites = true;
+
+  // Typical compression ratio of gzipped data.
+  static const size_t ExpectedRatio = 4;
+
  private:
-  Handle<Value> Init(const Arguments &args) {
+  InflateImpl()
+    : format_(DefaultFormat), dictionary_(0), memberEnded_(false),
+    magicHeld_(false), raw_(false), primeBits_(0), trailer_(0), input_(0),
+    output_(0), indexSpan_(0), lastPoint_(0), windowEnd_(0)
+  {}
+
+  // Access points met by close() are taken after Destroy().
+  ~InflateImpl() {
+    ClearAccessPoints(accessPoints_);
+    if (dictionary_ != 0) {
+      dictionary_->Release();
+    }
+  }
+
+
+  // Options are dictionary input was compressed with, which is not
+  // supported by gzip format, indexSpan, to report access points at least
+  // that many bytes of output apart, and accessPoint, to start
+  // decompression at.
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    Local<Value> point;
+    if (args.Length() > 0) {
+      if (!Dictionary::GetOption(args[0], dictionary_) ||
+          !GetIntegerOption(args[0], "indexSpan", 1, MaxIndexSpan,
+            indexSpan_)) {
+        return Undefined();
+      }
+      if (args[0]->IsObject()) {
+        point = args[0]->ToObject()->Get(String::NewSymbol("accessPoint"));
+      }
+    }
+    if (dictionary_ != 0 && format_ == Utils::FormatGzip) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("dictionary is not supported by gzip format"));
+      return ThrowException(exception);
+    }
+    raw_ = !point.IsEmpty() && !point->IsUndefined();
+
+    // Access points would be collected with their windows, just to be
+    // thrown away.
+    if (indexSpan_ != 0 && args.sync()) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("indexSpan is not supported by decompressSync"));
+      return ThrowException(exception);
+    }
+    if (indexSpan_ != 0 && !window_.GrowBy(WindowSize)) {
+      return ThrowException(Utils::GetException(Z_MEM_ERROR));
+    }
+
+    int ret = InitStream();
+    if (Utils::IsError(ret)) {
+      return ThrowException(Utils::GetException(ret));
+    }
+    if (raw_) {
+      return StartAt(point);
+    }
+    return Undefined();
+  }
+
+
+  // Initialize stream for format_, unless decompression starts at access
+  // point. Executed in any thread.
+  int InitStream() {
     stream_.zalloc = Z_NULL;
     stream_.zfree = Z_NULL;
     stream_.opaque = Z_NULL;
     stream_.avail_in = 0;
     stream_.next_in = Z_NULL;
+    // Not set by inflate() until input comes, but read by Finish().
+    stream_.data_type = 0;
 
-    int ret = inflateInit2(&stream_, 16 + MAX_WBITS);
-    if (Utils::IsError(ret)) {
-      return ThrowException(Utils::GetException(ret));
+    int ret = inflateInit2(&stream_,
+        raw_ ? -MAX_WBITS : Utils::WindowBits(format_));
+    COND_RETURN(Utils::IsError(ret) || raw_ || dictionary_ == 0, ret);
+
+    // Raw deflate has no header to ask for dictionary, so it is set at
+    // once, while zlib stream asks for it by Z_NEED_DICT.
+    if (format_ == Utils::FormatRaw) {
+      ret = SetDictionary();
+      COND_RETURN(Utils::IsError(ret), ret);
     }
-    return Undefined();
+    if (indexSpan_ != 0) {
+      // Output at the stream start might refer to dictionary.
+      AppendWindow(reinterpret_cast<const char*>(dictionary_->data()),
+          dictionary_->length());
+    }
+    return ret;
   }
 
 
+  int SetDictionary() {
+    return inflateSetDictionary(&stream_, dictionary_->data(),
+        dictionary_->length());
+  }
+
+
+  // Start decompression at access point, reported by indexing Gunzip.
+  // Input is expected to start at byte, which contains the point.
+  Handle<Value> StartAt(Handle<Value> value) {
+    uint64_t bit;
+    Local<Value> window;
+    if (!GetAccessPoint(value, WindowSize, bit, output_, window)) {
+      return Undefined();
+    }
+
+    input_ = bit >> 3;
+    primeBits_ = bit & 7;
+    lastPoint_ = output_;
+    if (!window.IsEmpty()) {
+      char *data = Buffer::Data(window->ToObject());
+      size_t length = Buffer::Length(window->ToObject());
+      int ret = inflateSetDictionary(&stream_,
+          reinterpret_cast<Bytef*>(data), length);
+      if (Utils::IsError(ret)) {
+        return ThrowException(Utils::GetException(ret));
+      }
+      if (indexSpan_ != 0) {
+        AppendWindow(data, length);
+      }
+    }
+    return Undefined();
+  }
+
+
+  // Input might consist of several gzip members, as made by concatenation
+  // of gzip files, which are decompressed as single stream. Data following
+  // the last member, which is not gzip member, is ignored, as gzip does.
+  // Zlib and raw streams are never concatenated, so data following them is
+  // ignored.
   int Write(char* data, int &dataLength, Blob &out) {
+    if (trailer_ != 0) {
+      return SkipTrailer(dataLength);
+    }
+    if (memberEnded_) {
+      COND_RETURN(dataLength == 0, Z_OK);
+      COND_RETURN(format_ != Utils::FormatGzip, Z_STREAM_END);
+      if (!magicHeld_ && dataLength == 1) {
+        // The first byte of magic is kept until the second one comes.
+        COND_RETURN(static_cast<unsigned char>(data[0]) != GzipMagic1,
+            Z_STREAM_END);
+        magicHeld_ = true;
+        dataLength = 0;
+        return Z_OK;
+      }
+      COND_RETURN(!IsMemberStart(data, magicHeld_), Z_STREAM_END);
+      int ret = raw_ ? Restart() : inflateReset(&stream_);
+      COND_RETURN(Utils::IsError(ret), ret);
+      memberEnded_ = false;
+      if (magicHeld_) {
+        magicHeld_ = false;
+        ret = InflateMagic();
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+    }
+    if (primeBits_ != 0) {
+      // Bits of the first byte preceding access point are dropped.
+      COND_RETURN(dataLength == 0, Z_OK);
+      unsigned char byte = static_cast<unsigned char>(data[0]);
+      int ret = inflatePrime(&stream_, 8 - primeBits_, byte >> primeBits_);
+      COND_RETURN(Utils::IsError(ret), ret);
+      primeBits_ = 0;
+      ++input_;
+      ++data;
+      --dataLength;
+    }
+
     stream_.next_in = reinterpret_cast<Bytef*>(data);
     stream_.avail_in = dataLength;
     stream_.next_out = out.data() + out.length();
     size_t initAvail = stream_.avail_out = out.avail();
 
-    int ret = inflate(&stream_, Z_NO_FLUSH);
+    // Indexing decompression stops at deflate block boundaries, which are
+    // the only positions to start at.
+    int ret = inflate(&stream_, indexSpan_ != 0 ? Z_BLOCK : Z_NO_FLUSH);
     dataLength = stream_.avail_in;
+    if (ret == Z_BUF_ERROR) {
+      // No progress possible, i.e. no input and no pending output.
+      ret = Z_OK;
+    }
+    if (ret == Z_NEED_DICT && dictionary_ != 0 &&
+        stream_.adler == dictionary_->id()) {
+      // Zlib header is read, but not counted by total_in, and the rest of
+      // input is decompressed by the next call.
+      input_ += stream_.next_in - reinterpret_cast<Bytef*>(data);
+      ret = SetDictionary();
+    }
     if (!Utils::IsError(ret)) {
-      out.IncreaseLengthBy(initAvail - stream_.avail_out);
+      size_t length = initAvail - stream_.avail_out;
+      if (indexSpan_ != 0) {
+        AppendWindow(reinterpret_cast<char*>(out.data() + out.length()),
+            length);
+      }
+      out.IncreaseLengthBy(length);
+    }
+    if (ret == Z_OK && indexSpan_ != 0 && AtBlockStart()) {
+      ret = AddAccessPoint();
+    }
+    if (ret == Z_STREAM_END) {
+      ret = EndMember();
     }
     return ret;
   }
 
 
-  int Finish(Blob &out) {
+  // Whether inflate() stopped before deflate block, which is not the last
+  // one.
+  bool AtBlockStart() const {
+    return (stream_.data_type & 128) != 0 && (stream_.data_type & 64) == 0;
+  }
+
+
+  // Whether inflate() stopped after the last deflate block.
+  bool AtLastBlockEnd() const {
+    return (stream_.data_type & 128) != 0 && (stream_.data_type & 64) != 0;
+  }
+
+
+  int AddAccessPoint() {
+    uint64_t output = output_ + stream_.total_out;
+    COND_RETURN(output - lastPoint_ < static_cast<uint64_t>(indexSpan_),
+        Z_OK);
+
+    AccessPoint *point = new(std::nothrow) AccessPoint();
+    COND_RETURN(point == 0, Z_MEM_ERROR);
+    if (!point->window.GrowBy(window_.length())) {
+      delete point;
+      return Z_MEM_ERROR;
+    }
+    point->input = (input_ + stream_.total_in) * 8 - (stream_.data_type & 7);
+    point->output = output;
+
+    // Window is circular, and starts at its end once filled up.
+    size_t start = window_.length() == WindowSize ? windowEnd_ : 0;
+    memcpy(point->window.data(), window_.data() + start,
+        window_.length() - start);
+    memcpy(point->window.data() + window_.length() - start, window_.data(),
+        start);
+    point->window.IncreaseLengthBy(window_.length());
+
+    if (!accessPoints_.Push(point)) {
+      delete point;
+      return Z_MEM_ERROR;
+    }
+    lastPoint_ = output;
+    return Z_OK;
+  }
+
+
+  // Keep the last WindowSize bytes of output.
+  void AppendWindow(const char *data, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    if (length > WindowSize) {
+      data += length - WindowSize;
+      length = WindowSize;
+    }
+    size_t head = WindowSize - windowEnd_;
+    if (head > length) {
+      head = length;
+    }
+    memcpy(window_.data() + windowEnd_, data, head);
+    memcpy(window_.data(), data + head, length - head);
+    windowEnd_ = (windowEnd_ + length) % WindowSize;
+    window_.IncreaseLengthBy(
+        length < window_.avail() ? length : window_.avail());
+  }
+
+
+  int EndMember() {
+    input_ += stream_.total_in;
+    output_ += stream_.total_out;
+    if (raw_ && TrailerLength() != 0) {
+      // Trailer of member started at access point is not checked, as its
+      // check value covers output preceding the point.
+      trailer_ = TrailerLength();
+      return Z_OK;
+    }
+    // Next member, if any, is checked when its input comes.
+    memberEnded_ = true;
+    return PushBoundary();
+  }
+
+
+  int SkipTrailer(int &dataLength) {
+    int length = dataLength < trailer_ ? dataLength : trailer_;
+    dataLength -= length;
+    trailer_ -= length;
+    input_ += length;
+    COND_RETURN(trailer_ != 0, Z_OK);
+    memberEnded_ = true;
+    return PushBoundary();
+  }
+
+
+  int PushBoundary() {
+    MemberBoundary boundary = { input_, output_ };
+    return boundaries_.Push(boundary) ? Z_OK : Z_MEM_ERROR;
+  }
+
+
+  // Switch from raw deflate of member started at access point to gzip
+  // members following it.
+  int Restart() {
+    inflateEnd(&stream_);
+    raw_ = false;
+    return inflateInit2(&stream_, Utils::WindowBits(format_));
+  }
+
+
+  // Check value and, for gzip, length, which follow deflate data.
+  int TrailerLength() const {
+    switch (format_) {
+      case Utils::FormatZlib:
+        return 4;
+      case Utils::FormatRaw:
+        return 0;
+      default:
+        return 8;
+    }
+  }
+
+
+  // Whether data start gzip member, or follow its first byte, if held.
+  static bool IsMemberStart(const char *data, bool held) {
+    const unsigned char *bytes =
+      reinterpret_cast<const unsigned char*>(data);
+    if (held) {
+      return bytes[0] == GzipMagic2;
+    }
+    return bytes[0] == GzipMagic1 && bytes[1] == GzipMagic2;
+  }
+
+
+  // Pass the first byte of magic, held by Write(), to inflate of member.
+  // Header produces no output.
+  int InflateMagic() {
+    Bytef magic = GzipMagic1;
+    Bytef unused;
+    stream_.next_in = &magic;
+    stream_.avail_in = 1;
+    stream_.next_out = &unused;
+    stream_.avail_out = 0;
+    int ret = inflate(&stream_, Z_NO_FLUSH);
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+  }
+
+
+  // Expected output size for dataLength bytes of input.
+  size_t WriteSizeHint(int dataLength) {
+    return dataLength * ExpectedRatio + 1;
+  }
+
+
+  size_t FinishSizeHint() {
+    return 0;
+  }
+
+
+  // Decompressor outputs as much as possible anyway, so flush does nothing,
+  // but mode is checked as for compressor.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
     return Z_OK;
   }
 
 
+  int Finish(Blob &out) {
+    if (!memberEnded_ && trailer_ == 0 && indexSpan_ != 0 &&
+        AtLastBlockEnd()) {
+      // Indexing inflate() stops after the last block, and raw deflate
+      // stream has no trailer to call it again with.
+      int dataLength = 0;
+      int ret = Write(0, dataLength, out);
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    // Input must end at member boundary.
+    return memberEnded_ ? Z_STREAM_END : Z_BUF_ERROR;
+  }
+
+
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {
+    MoveBoundaries(boundaries_, boundaries);
+  }
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {
+    MoveAccessPoints(accessPoints_, points);
+  }
+
+
   void Destroy() {
     inflateEnd(&stream_);
   }
 
  private:
+  // The first two bytes of gzip member.
+  static const unsigned char GzipMagic1 = 0x1f;
+  static const unsigned char GzipMagic2 = 0x8b;
+
+  // Deflate window, i.e. how far back decompression might refer.
+  static const size_t WindowSize = 1 << MAX_WBITS;
+
+  static const int MaxIndexSpan = 1 << 30;
+
   z_stream stream_;
+
+  // DefaultFormat, unless input is told by AutoDecompressImpl.
+  GzipUtils::Format format_;
+  Dictionary *dictionary_;
+
+  // Whether input so far ends at member boundary, and whether it ends with
+  // the first byte of next member.
+  bool memberEnded_;
+  bool magicHeld_;
+
+  // Whether member started at access point is decompressed, its bits
+  // to take from the first input byte, and its trailer bytes to skip.
+  bool raw_;
+  int primeBits_;
+  int trailer_;
+
+  // Input and output of members ended so far, and their ends not yet taken.
+  uint64_t input_;
+  uint64_t output_;
+  Queue<MemberBoundary> boundaries_;
+
+  // Access points not yet taken, output of the last one, and the last
+  // WindowSize bytes of output, if indexing.
+  int indexSpan_;
+  uint64_t lastPoint_;
+  Queue<AccessPoint*> accessPoints_;
+  ScopedBlob window_;
+  size_t windowEnd_;
 };
-const char GunzipImpl::Name[] = "Gunzip";
+typedef InflateImpl<GzipUtils::FormatGzip> GunzipImpl;
+typedef InflateImpl<GzipUtils::FormatZlib> ZlibInflateImpl;
+typedef InflateImpl<GzipUtils::FormatRaw> RawInflateImpl;
+template <> const char GunzipImpl::Name[] = "Gunzip";
+template <> const char ZlibInflateImpl::Name[] = "Inflate";
+template <> const char RawInflateImpl::Name[] = "InflateRaw";
 typedef ZipLib<GunzipImpl> Gunzip;
+typedef ZipLib<ZlibInflateImpl> Inflate;
+typedef ZipLib<RawInflateImpl> InflateRaw;
+
+
+
+// Raw deflate of single block for ParallelGzipImpl. Block is primed with
+// preceding input, so compression ratio is close to serial one, and ends on
+// byte boundary, so compressed blocks might be concatenated.
+class DeflateBlockJob : public ParallelOutputJob<GzipUtils::Blob> {
+  friend class ParallelGzipImpl;
+
+ public:
+  DeflateBlockJob(int level, bool last)
+    : level_(level), last_(last), dictionaryLength_(0), length_(0), crc_(0)
+  {}
+
+ protected:
+  virtual void Run() {
+    size_t length = length_ = input_.length() - dictionaryLength_;
+    crc_ = crc32(0L, input_.data() + dictionaryLength_, length);
+
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    status_ = deflateInit2(&stream, level_, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY);
+    if (Utils::IsError(status_)) {
+      return;
+    }
+    if (dictionaryLength_ > 0) {
+      status_ = deflateSetDictionary(&stream, input_.data(),
+          dictionaryLength_);
+    }
+
+    if (!Utils::IsError(status_)) {
+      status_ = output_.Reserve(deflateBound(&stream, length) + FlushLength) ?
+        Z_OK : Z_MEM_ERROR;
+    }
+    if (!Utils::IsError(status_)) {
+      stream.next_in = input_.data() + dictionaryLength_;
+      stream.avail_in = length;
+      stream.next_out = output_.data() + output_.length();
+      size_t initAvail = stream.avail_out = output_.avail();
+
+      status_ = deflate(&stream, last_ ? Z_FINISH : Z_SYNC_FLUSH);
+      output_.IncreaseLengthBy(initAvail - stream.avail_out);
+      if (status_ == Z_STREAM_END || (status_ == Z_OK && !last_)) {
+        status_ = Z_OK;
+      } else if (!Utils::IsError(status_)) {
+        // Output bound was not enough.
+        status_ = Z_BUF_ERROR;
+      }
+    }
+    deflateEnd(&stream);
+
+    // Input is not needed anymore.
+    input_.Free();
+  }
+
+ private:
+  typedef GzipUtils Utils;
+
+  // Empty stored block appended by sync flush.
+  static const size_t FlushLength = 5;
+
+  int level_;
+  bool last_;
+
+  // Dictionary followed by block itself.
+  Blob input_;
+  size_t dictionaryLength_;
+
+  // Length and CRC32 of block, accessed by processor when job is done.
+  size_t length_;
+  uLong crc_;
+};
+
+
+// Gzip compressor, which splits input into blocks and deflates them on
+// several threads, as pigz does. Output is single gzip member, which is
+// a bit larger than serial one, as matches never cross block boundaries.
+class ParallelGzipImpl {
+  friend class ZipLib<ParallelGzipImpl>;
+
+  typedef GzipUtils Utils;
+  typedef GzipUtils::Blob Blob;
+
+ private:
+  static const char Name[];
+
+  // Write may wait for earlier blocks, so it is never done in V8 thread.
+  static const bool InlineWrites = false;
+
+  static const int DefaultBlockSize = 128 * 1024;
+  static const int MinBlockSize = 1024;
+  static const int MaxThreads = 256;
+
+  // Deflate window, i.e. length of preceding input used as dictionary.
+  static const size_t WindowSize = 1 << MAX_WBITS;
+
+  static const size_t HeaderLength = 10;
+  static const size_t TrailerLength = 8;
+
+ private:
+  ParallelGzipImpl()
+    : block_(0), frameOffset_(0), frameLength_(0)
+  {}
+
+
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    level_ = Z_DEFAULT_COMPRESSION;
+    if (args.Length() > 0 && !args[0]->IsUndefined()) {
+      if (!args[0]->IsInt32() || args[0]->Int32Value() < -1 ||
+          args[0]->Int32Value() > 9) {
+        Local<Value> exception = Exception::TypeError(
+            String::New("level must be an integer"));
+        return ThrowException(exception);
+      }
+      level_ = args[0]->Int32Value();
+    }
+
+    int blockSize = DefaultBlockSize;
+    threads_ = ParallelPool::DefaultThreads();
+    if (args.Length() > 1 &&
+        (!GetIntegerOption(args[1], "blockSize", MinBlockSize, 1 << 30,
+            blockSize) ||
+         !GetIntegerOption(args[1], "threads", 1, MaxThreads, threads_))) {
+      return Undefined();
+    }
+    blockSize_ = blockSize;
+
+    if (!window_.GrowBy(WindowSize)) {
+      return ThrowException(Utils::GetException(Z_MEM_ERROR));
+    }
+
+    totalIn_ = 0;
+    crc_ = crc32(0L, Z_NULL, 0);
+    finished_ = false;
+    block_ = 0;
+
+    // Header is the same as one written by deflate().
+    Bytef header[HeaderLength] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0,
+      OsCode };
+    if (level_ == 9) {
+      header[8] = 2;
+    } else if (level_ == 1) {
+      header[8] = 4;
+    }
+    SetFrame(header, HeaderLength);
+    return Undefined();
+  }
+
+
+  int Write(char *data, int &dataLength, Blob &out) {
+    int ret = Drain(out, false);
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    while (dataLength > 0) {
+      if (jobs_.length() >= Backlog()) {
+        // Caller is ahead of compression.
+        ret = Drain(out, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (jobs_.length() >= Backlog()) {
+          // Output is full.
+          break;
+        }
+      }
+
+      if (block_ == 0) {
+        ret = NewBlock(false);
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+      size_t length = blockSize_ - (block_->input_.length() -
+          block_->dictionaryLength_);
+      if (length > static_cast<size_t>(dataLength)) {
+        length = dataLength;
+      }
+      memcpy(block_->input_.data() + block_->input_.length(), data, length);
+      block_->input_.IncreaseLengthBy(length);
+      data += length;
+      dataLength -= length;
+      totalIn_ += length;
+
+      if (block_->input_.length() - block_->dictionaryLength_ ==
+          static_cast<size_t>(blockSize_)) {
+        ret = Submit();
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+    }
+    return Drain(out, false);
+  }
+
+
+  // Output of already compressed blocks. Geometric growth of output takes
+  // care of the rest.
+  size_t WriteSizeHint(int dataLength) {
+    return frameLength_ - frameOffset_ + jobs_.ReadyLength();
+  }
+
+
+  // Upper bound of output for all the input written.
+  size_t FinishSizeHint() {
+    size_t length = frameLength_ - frameOffset_ + TrailerLength +
+      jobs_.ReadyLength();
+    for (size_t i = 0; i < jobs_.length(); ++i) {
+      DeflateBlockJob *job = jobs_[i];
+      if (!ParallelPool::Done(job)) {
+        length += BlockBound(job->input_.length() - job->dictionaryLength_);
+      }
+    }
+    if (block_ != 0) {
+      length += BlockBound(block_->input_.length() -
+          block_->dictionaryLength_);
+    }
+    return length;
+  }
+
+
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return GzipImpl::GetFlushMode(value, mode);
+  }
+
+
+  // Compress buffered input and pass all the output. Blocks always end on
+  // byte boundary, full flush also makes next block independent of
+  // preceding input.
+  int Flush(int mode, Blob &out) {
+    if (block_ != 0) {
+      int ret = Submit();
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    if (mode == Z_FULL_FLUSH) {
+      window_.ResetLength();
+    }
+    return Drain(out, true);
+  }
+
+
+  int Finish(Blob &out) {
+    if (!finished_) {
+      // Last block, even if empty, ends deflate stream.
+      if (block_ == 0) {
+        int ret = NewBlock(true);
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+      block_->last_ = true;
+      int ret = Submit();
+      COND_RETURN(Utils::IsError(ret), ret);
+      finished_ = true;
+    }
 
+    int ret = Drain(out, true);
+    COND_RETURN(Utils::IsError(ret), ret);
+    if (jobs_.length() == 0 && frameOffset_ == frameLength_) {
+      return Z_STREAM_END;
+    }
+    return Z_OK;
+  }
+
+
+  // Compressor input is not split into members, nor indexed.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {}
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
+  void Destroy() {
+    jobs_.Clear();
+    delete block_;
+    block_ = 0;
+    window_.Free();
+  }
+
+ private:
+  // Start new block primed with preceding input.
+  int NewBlock(bool last) {
+    block_ = new(std::nothrow) DeflateBlockJob(level_, last);
+    COND_RETURN(block_ == 0, Z_MEM_ERROR);
+
+    size_t dictionaryLength = window_.length();
+    COND_RETURN(!block_->input_.GrowBy(dictionaryLength + blockSize_),
+        Z_MEM_ERROR);
+    memcpy(block_->input_.data(), window_.data(), dictionaryLength);
+    block_->input_.IncreaseLengthBy(dictionaryLength);
+    block_->dictionaryLength_ = dictionaryLength;
+    return Z_OK;
+  }
+
+
+  // Queue current block for compression.
+  int Submit() {
+    DeflateBlockJob *job = block_;
+    size_t length = job->input_.length() - job->dictionaryLength_;
+    if (length == 0 && !job->last_) {
+      delete job;
+      block_ = 0;
+      return Z_OK;
+    }
+
+    // Keep last WindowSize bytes of input to prime next block.
+    const Bytef *end = job->input_.data() + job->input_.length();
+    size_t windowLength = job->input_.length() < WindowSize ?
+      job->input_.length() : WindowSize;
+    window_.ResetLength();
+    memcpy(window_.data(), end - windowLength, windowLength);
+    window_.IncreaseLengthBy(windowLength);
+
+    block_ = 0;
+    COND_RETURN(!jobs_.Push(job, threads_), Z_MEM_ERROR);
+    return Z_OK;
+  }
+
+
+  // Pass output of compressed blocks in order, while output space is
+  // available. If wait is true, wait for blocks being compressed, so that
+  // output size hints account for them.
+  int Drain(Blob &out, bool wait) {
+    CopyFrame(out);
+
+    while (jobs_.FrontDone(wait)) {
+      DeflateBlockJob *job = jobs_.Front();
+      COND_RETURN(Utils::IsError(job->status()), job->status());
+      if (!jobs_.CopyFront(out)) {
+        break;
+      }
+
+      crc_ = crc32_combine(crc_, job->crc_, job->length_);
+      if (job->last_) {
+        Bytef trailer[TrailerLength];
+        PutLong(trailer, crc_);
+        PutLong(trailer + 4, totalIn_);
+        SetFrame(trailer, TrailerLength);
+      }
+      delete jobs_.Pop();
+
+      CopyFrame(out);
+    }
+    return Z_OK;
+  }
+
+
+  void SetFrame(const Bytef *data, size_t length) {
+    memcpy(frame_, data, length);
+    frameOffset_ = 0;
+    frameLength_ = length;
+  }
+
+
+  // Pass gzip header or trailer, as much as output space allows.
+  void CopyFrame(Blob &out) {
+    size_t length = frameLength_ - frameOffset_;
+    if (length > out.avail()) {
+      length = out.avail();
+    }
+    memcpy(out.data() + out.length(), frame_ + frameOffset_, length);
+    out.IncreaseLengthBy(length);
+    frameOffset_ += length;
+  }
+
+
+  // Maximum number of blocks queued for compression or waiting for output.
+  size_t Backlog() const {
+    return 2 * threads_;
+  }
+
+
+  static size_t BlockBound(size_t length) {
+    return compressBound(length) + DeflateBlockJob::FlushLength;
+  }
+
+
+  static void PutLong(Bytef *data, uLong value) {
+    for (int i = 0; i < 4; ++i) {
+      data[i] = static_cast<Bytef>(value >> (8 * i));
+    }
+  }
+
+ private:
+  // Operating system field of gzip header, as zlib sets it on Unix.
+  static const Bytef OsCode = 3;
+
+  int level_;
+  size_t blockSize_;
+  int threads_;
+
+  // Blocks being compressed or waiting for output, in order.
+  ParallelQueue<DeflateBlockJob> jobs_;
+
+  // Block being filled by input, or 0.
+  DeflateBlockJob *block_;
+
+  // Last input, which primes next block.
+  Blob window_;
+
+  uLong totalIn_;
+  uLong crc_;
+  bool finished_;
+
+  // Gzip header or trailer not yet passed to output.
+  Bytef frame_[HeaderLength];
+  size_t frameOffset_;
+  size_t frameLength_;
+};
+const char ParallelGzipImpl::Name[] = "ParallelGzip";
+typedef ZipLib<ParallelGzipImpl> ParallelGzip;
+
+
+
+// Inflate of single gzip member for ParallelGunzipImpl.
+class InflateMemberJob : public ParallelOutputJob<GzipUtils::Blob> {
+  friend class ParallelGunzipImpl;
+
+ public:
+  InflateMemberJob()
+    : length_(0)
+  {}
+
+ protected:
+  virtual void Run() {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = Z_NULL;
+    stream.avail_in = 0;
+    status_ = inflateInit2(&stream, 16 + MAX_WBITS);
+    if (Utils::IsError(status_)) {
+      return;
+    }
+
+    // Member trailer holds uncompressed length, which is trusted as far as
+    // deflate ratio allows.
+    const Bytef *trailer = input_.data() + input_.length() - 4;
+    size_t hint = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+      (static_cast<size_t>(trailer[3]) << 24);
+    if (hint > input_.length() * MaxRatio) {
+      hint = input_.length() * MaxRatio;
+    }
+
+    stream.next_in = input_.data();
+    stream.avail_in = input_.length();
+    do {
+      if (!output_.Reserve(hint + 1)) {
+        status_ = Z_MEM_ERROR;
+        break;
+      }
+      stream.next_out = output_.data() + output_.length();
+      size_t initAvail = stream.avail_out = output_.avail();
+      status_ = inflate(&stream, Z_NO_FLUSH);
+      output_.IncreaseLengthBy(initAvail - stream.avail_out);
+      if (status_ == Z_OK && stream.avail_in == 0 && stream.avail_out != 0) {
+        // Member is truncated.
+        status_ = Z_DATA_ERROR;
+      }
+    } while (status_ == Z_OK);
+    inflateEnd(&stream);
+
+    if (status_ == Z_STREAM_END) {
+      // Member must end where its header says.
+      status_ = stream.avail_in == 0 ? Z_OK : Z_DATA_ERROR;
+    }
+    input_.Free();
+  }
+
+ private:
+  typedef GzipUtils Utils;
+
+  // Maximum compression ratio of deflate.
+  static const size_t MaxRatio = 1032;
+
+  // Member, which is freed once inflated, and its length.
+  Blob input_;
+  size_t length_;
+};
+
+
+// Gunzip decompressor, which inflates members of multi-member input on
+// several threads. Length of member is known before it is inflated only if
+// member has BGZF extra field, as bgzip and samtools write. Other members
+// are inflated serially, as by Gunzip.
+class ParallelGunzipImpl {
+  friend class ZipLib<ParallelGunzipImpl>;
+
+  typedef GzipUtils Utils;
+  typedef GzipUtils::Blob Blob;
+  typedef InflateMemberJob Job;
+
+ private:
+  static const char Name[];
+
+  // Write may wait for earlier members, so it is never done in V8 thread.
+  static const bool InlineWrites = false;
+
+  static const int MaxThreads = 256;
+
+  // Input buffered at once. BGZF member is never larger.
+  static const int ScanChunk = 64 * 1024;
+
+  static const size_t ExpectedRatio = 4;
+
+  static const size_t HeaderLength = 10;
+  static const size_t TrailerLength = 8;
+
+ private:
+  ParallelGunzipImpl()
+    : start_(0), members_(0), serial_(false), trailing_(false), input_(0),
+    output_(0)
+  {}
+
+
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    threads_ = ParallelPool::DefaultThreads();
+    if (args.Length() > 0 &&
+        !GetIntegerOption(args[0], "threads", 1, MaxThreads, threads_)) {
+      return Undefined();
+    }
+
+    stream_.zalloc = Z_NULL;
+    stream_.zfree = Z_NULL;
+    stream_.opaque = Z_NULL;
+    stream_.avail_in = 0;
+    stream_.next_in = Z_NULL;
+
+    int ret = inflateInit2(&stream_, 16 + MAX_WBITS);
+    if (Utils::IsError(ret)) {
+      return ThrowException(Utils::GetException(ret));
+    }
+    return Undefined();
+  }
+
+
+  int Write(char *data, int &dataLength, Blob &out) {
+    int ret = Drain(out, false);
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    while (true) {
+      if (trailing_ || serial_) {
+        // Output of preceding members goes first.
+        ret = Drain(out, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (jobs_.length() != 0) {
+          if (out.borrowed()) {
+            break;
+          }
+          COND_RETURN(!out.Reserve(jobs_.ReadyLength()), Z_MEM_ERROR);
+          continue;
+        }
+      }
+
+      if (trailing_) {
+        dataLength = 0;
+        return Z_STREAM_END;
+      }
+
+      if (serial_) {
+        bool progress;
+        ret = InflateSerial(data, dataLength, out, progress);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (serial_ && (!progress || (out.borrowed() && out.avail() == 0))) {
+          break;
+        }
+        continue;
+      }
+
+      ret = SubmitMembers();
+      COND_RETURN(Utils::IsError(ret), ret);
+      if (serial_ || trailing_) {
+        continue;
+      }
+
+      if (dataLength == 0) {
+        break;
+      }
+      if (jobs_.length() >= Backlog()) {
+        // Caller is ahead of decompression.
+        ret = Drain(out, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (jobs_.length() >= Backlog()) {
+          // Output is full.
+          break;
+        }
+      }
+
+      int length = dataLength < ScanChunk ? dataLength : ScanChunk;
+      ret = Append(data, length);
+      COND_RETURN(Utils::IsError(ret), ret);
+      data += length;
+      dataLength -= length;
+    }
+    return Drain(out, false);
+  }
+
+
+  // Output of already inflated members, and of serial inflate.
+  size_t WriteSizeHint(int dataLength) {
+    size_t length = jobs_.ReadyLength();
+    if (serial_) {
+      length += (buffered() + dataLength) * ExpectedRatio + 1;
+    }
+    return length;
+  }
+
+
+  size_t FinishSizeHint() {
+    size_t length = jobs_.ReadyLength();
+    for (size_t i = 0; i < jobs_.length(); ++i) {
+      Job *job = jobs_[i];
+      if (!ParallelPool::Done(job)) {
+        length += job->input_.length() * ExpectedRatio;
+      }
+    }
+    return length;
+  }
+
+
+  // Decompressor outputs as much as possible anyway, so flush does nothing,
+  // but mode is checked as for compressor.
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return Utils::GetFlushMode(value, mode);
+  }
+
+
+  int Flush(int mode, Blob &out) {
+    return Z_OK;
+  }
+
+
+  int Finish(Blob &out) {
+    // Buffered input is processed first.
+    int length = 0;
+    int ret = Write(0, length, out);
+    COND_RETURN(Utils::IsError(ret) || ret == Z_STREAM_END, ret);
+    COND_RETURN(out.borrowed() && out.avail() == 0, Z_OK);
+
+    // Single byte following the last member is not a member, as for Gunzip.
+    if (!serial_ && members_ != 0 && buffered() == 1) {
+      trailing_ = true;
+      ++start_;
+    }
+
+    // Input must end at member boundary, as for Gunzip.
+    COND_RETURN(serial_ || members_ == 0 || buffered() != 0, Z_BUF_ERROR);
+
+    ret = Drain(out, true);
+    COND_RETURN(Utils::IsError(ret), ret);
+    return jobs_.length() == 0 ? Z_STREAM_END : Z_OK;
+  }
+
+
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {
+    MoveBoundaries(boundaries_, boundaries);
+  }
+
+
+  // Members are decompressed separately, so input is indexed by Gunzip.
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
+  void Destroy() {
+    jobs_.Clear();
+    buffer_.Free();
+    inflateEnd(&stream_);
+  }
+
+ private:
+  // Append input to buffer, dropping already consumed part of it.
+  int Append(const char *data, int length) {
+    if (start_ > buffer_.length() / 2) {
+      size_t rest = buffered();
+      memmove(buffer_.data(), buffer_.data() + start_, rest);
+      buffer_.ResetLength();
+      buffer_.IncreaseLengthBy(rest);
+      start_ = 0;
+    }
+
+    COND_RETURN(!buffer_.Reserve(length), Z_MEM_ERROR);
+    memcpy(buffer_.data() + buffer_.length(), data, length);
+    buffer_.IncreaseLengthBy(length);
+    return Z_OK;
+  }
+
+
+  // Submit buffered members for inflate, until either member without BGZF
+  // extra field, which switches to serial inflate, or incomplete member is
+  // met.
+  int SubmitMembers() {
+    while (buffered() != 0) {
+      const Bytef *header = buffer_.data() + start_;
+      if (header[0] == GzipMagic[0] && buffered() < 2) {
+        // Magic is told by its second byte.
+        return Z_OK;
+      }
+      if (header[0] != GzipMagic[0] || header[1] != GzipMagic[1]) {
+        // The first member is not gzip one, or data after the last member,
+        // which is ignored, as gzip does.
+        COND_RETURN(members_ == 0, Z_DATA_ERROR);
+        trailing_ = true;
+        return Z_OK;
+      }
+
+      size_t length;
+      int ret = GetMemberLength(header, buffered(), length);
+      if (ret == Z_BUF_ERROR) {
+        // Header is incomplete.
+        return Z_OK;
+      }
+      COND_RETURN(Utils::IsError(ret), ret);
+      if (length == 0) {
+        ret = inflateReset(&stream_);
+        COND_RETURN(Utils::IsError(ret), ret);
+        serial_ = true;
+        ++members_;
+        return Z_OK;
+      }
+      if (length > buffered()) {
+        return Z_OK;
+      }
+
+      Job *job = new(std::nothrow) Job();
+      COND_RETURN(job == 0, Z_MEM_ERROR);
+      if (!job->input_.GrowBy(length)) {
+        delete job;
+        return Z_MEM_ERROR;
+      }
+      memcpy(job->input_.data(), header, length);
+      job->input_.IncreaseLengthBy(length);
+      job->length_ = length;
+      COND_RETURN(!jobs_.Push(job, threads_), Z_MEM_ERROR);
+      start_ += length;
+      ++members_;
+    }
+    return Z_OK;
+  }
+
+
+  // Total length of member, which header starts with magic, from its BGZF
+  // extra field, or 0 if there is no such field. Returns Z_BUF_ERROR if
+  // more of header is needed.
+  static int GetMemberLength(const Bytef *header, size_t available,
+      size_t &length) {
+    length = 0;
+    COND_RETURN(available < HeaderLength, Z_BUF_ERROR);
+    COND_RETURN(header[2] != Z_DEFLATED, Z_DATA_ERROR);
+    if ((header[3] & ExtraFlag) == 0) {
+      return Z_OK;
+    }
+
+    COND_RETURN(available < HeaderLength + 2, Z_BUF_ERROR);
+    size_t extraLength = header[10] | (header[11] << 8);
+    COND_RETURN(available < HeaderLength + 2 + extraLength, Z_BUF_ERROR);
+
+    // Extra field is a list of subfields with 2-byte id and length.
+    const Bytef *extra = header + HeaderLength + 2;
+    for (size_t i = 0; i + 4 <= extraLength; ) {
+      size_t subfieldLength = extra[i + 2] | (extra[i + 3] << 8);
+      if (extra[i] == 'B' && extra[i + 1] == 'C' && subfieldLength == 2 &&
+          i + 6 <= extraLength) {
+        length = (extra[i + 4] | (extra[i + 5] << 8)) + 1;
+        COND_RETURN(length < HeaderLength + 2 + extraLength + TrailerLength,
+            Z_DATA_ERROR);
+        return Z_OK;
+      }
+      i += 4 + subfieldLength;
+    }
+    return Z_OK;
+  }
+
+
+  // Inflate member without BGZF extra field, buffered input first. Switches
+  // back to member submission at the end of member.
+  int InflateSerial(char *&data, int &dataLength, Blob &out,
+      bool &progress) {
+    // Space is reserved by caller before member kind is known.
+    COND_RETURN(!out.borrowed() && !out.Reserve(WriteSizeHint(dataLength)),
+        Z_MEM_ERROR);
+
+    bool buffer = buffered() != 0;
+    size_t initIn = stream_.avail_in =
+      buffer ? buffered() : static_cast<size_t>(dataLength);
+    stream_.next_in = buffer ? buffer_.data() + start_ :
+      reinterpret_cast<Bytef*>(data);
+    stream_.next_out = out.data() + out.length();
+    size_t initAvail = stream_.avail_out = out.avail();
+
+    int ret = inflate(&stream_, Z_NO_FLUSH);
+    if (ret == Z_BUF_ERROR) {
+      // No progress possible, i.e. no input and no pending output.
+      ret = Z_OK;
+    }
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    size_t consumed = initIn - stream_.avail_in;
+    out.IncreaseLengthBy(initAvail - stream_.avail_out);
+    progress = consumed != 0 || stream_.avail_out != initAvail;
+    if (buffer) {
+      start_ += consumed;
+    } else {
+      data += consumed;
+      dataLength -= consumed;
+    }
+
+    if (ret == Z_STREAM_END) {
+      serial_ = false;
+      return EndMember(stream_.total_in, stream_.total_out);
+    }
+    return Z_OK;
+  }
+
+
+  int EndMember(uint64_t input, uint64_t output) {
+    input_ += input;
+    output_ += output;
+    MemberBoundary boundary = { input_, output_ };
+    return boundaries_.Push(boundary) ? Z_OK : Z_MEM_ERROR;
+  }
+
+
+  size_t buffered() const {
+    return buffer_.length() - start_;
+  }
+
+
+  // Pass output of inflated members in order, while output space is
+  // available. If wait is true, wait for members being inflated, so that
+  // output size hints account for them.
+  int Drain(Blob &out, bool wait) {
+    while (jobs_.FrontDone(wait)) {
+      Job *job = jobs_.Front();
+      COND_RETURN(Utils::IsError(job->status()), job->status());
+      if (!jobs_.CopyFront(out)) {
+        break;
+      }
+      int ret = EndMember(job->length_, job->output_.length());
+      COND_RETURN(Utils::IsError(ret), ret);
+      delete jobs_.Pop();
+    }
+    return Z_OK;
+  }
+
+
+  // Maximum number of members queued for inflate or waiting for output.
+  size_t Backlog() const {
+    return 2 * threads_;
+  }
+
+ private:
+  static const Bytef GzipMagic[2];
+  static const Bytef ExtraFlag = 4;
+
+  int threads_;
+
+  // Input starting at byte start_, which is not yet submitted or inflated.
+  Blob buffer_;
+  size_t start_;
+
+  // Members inflated on several threads or waiting for output, in order.
+  ParallelQueue<Job> jobs_;
+  int members_;
+
+  // Stream of member inflated serially, and whether it is in progress.
+  z_stream stream_;
+  bool serial_;
+
+  // Whether the rest of input follows the last member.
+  bool trailing_;
+
+  // Input and output of members passed so far, and their ends not yet
+  // taken.
+  uint64_t input_;
+  uint64_t output_;
+  Queue<MemberBoundary> boundaries_;
+};
+const char ParallelGunzipImpl::Name[] = "ParallelGunzip";
+const Bytef ParallelGunzipImpl::GzipMagic[2] = { 0x1f, 0x8b };
+typedef ZipLib<ParallelGunzipImpl> ParallelGunzip;
+
+
+
+// Compression of single BGZF block, i.e. gzip member with BC extra field
+// holding member size, for BgzfImpl.
+class BgzfBlockJob : public ParallelOutputJob<GzipUtils::Blob> {
+  friend class BgzfImpl;
+
+ public:
+  explicit BgzfBlockJob(int level)
+    : level_(level), length_(0)
+  {}
+
+ protected:
+  virtual void Run() {
+    length_ = input_.length();
+    status_ = output_.Reserve(MaxBlockLength) ? Z_OK : Z_MEM_ERROR;
+    if (!Utils::IsError(status_)) {
+      status_ = Deflate(level_);
+      if (status_ == Z_BUF_ERROR) {
+        // Incompressible data fits into block, if stored.
+        status_ = Deflate(Z_NO_COMPRESSION);
+      }
+    }
+    if (Utils::IsError(status_)) {
+      return;
+    }
+
+    size_t length = output_.length();
+    Bytef *header = output_.data();
+    memcpy(header, Header, HeaderLength);
+    header[HeaderLength - 2] = static_cast<Bytef>((length - 1) & 0xff);
+    header[HeaderLength - 1] = static_cast<Bytef>((length - 1) >> 8);
+
+    // Input is not needed anymore.
+    input_.Free();
+  }
+
+ private:
+  // Deflate input into output following header, and append trailer.
+  // Returns Z_BUF_ERROR if block does not fit into maximum size.
+  int Deflate(int level) {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    int ret = deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY);
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    stream.next_in = input_.data();
+    stream.avail_in = input_.length();
+    stream.next_out = output_.data() + HeaderLength;
+    stream.avail_out = MaxBlockLength - HeaderLength - TrailerLength;
+    ret = deflate(&stream, Z_FINISH);
+    size_t length = stream.total_out;
+    deflateEnd(&stream);
+    COND_RETURN(ret == Z_OK, Z_BUF_ERROR);
+    COND_RETURN(ret != Z_STREAM_END, ret);
+
+    Bytef *trailer = output_.data() + HeaderLength + length;
+    uLong crc = crc32(0L, input_.data(), input_.length());
+    for (int i = 0; i < 4; ++i) {
+      trailer[i] = static_cast<Bytef>(crc >> (8 * i));
+      trailer[4 + i] = static_cast<Bytef>(input_.length() >> (8 * i));
+    }
+    output_.ResetLength();
+    output_.IncreaseLengthBy(HeaderLength + length + TrailerLength);
+    return Z_OK;
+  }
+
+ private:
+  typedef GzipUtils Utils;
+
+  static const Bytef Header[];
+  static const size_t HeaderLength = 18;
+  static const size_t TrailerLength = 8;
+
+  // Block size is stored as 16-bit value less 1.
+  static const size_t MaxBlockLength = 1 << 16;
+
+  int level_;
+
+  // Input, which is freed once compressed, and its length.
+  Blob input_;
+  size_t length_;
+};
+const Bytef BgzfBlockJob::Header[] = {
+  0x1f, 0x8b, Z_DEFLATED, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+
+// BGZF compressor, as bgzip and samtools write. Output is series of gzip
+// members, each holding up to 64K of input, which allows random access by
+// virtual offsets. Members are independent, so they are compressed on
+// several threads.
+class BgzfImpl {
+  friend class ZipLib<BgzfImpl>;
+
+  typedef GzipUtils Utils;
+  typedef GzipUtils::Blob Blob;
+  typedef BgzfBlockJob Job;
+
+ private:
+  static const char Name[];
+
+  // Write may wait for earlier blocks, so it is never done in V8 thread.
+  static const bool InlineWrites = false;
+
+  static const int MaxThreads = 256;
+
+  // Input of single block, as bgzip uses, so that even stored block fits
+  // into 64K.
+  static const size_t BlockInputLength = 0xff00;
+
+  // Empty block, which marks end of file.
+  static const Bytef EofBlock[];
+  static const size_t EofLength = 28;
+
+ private:
+  BgzfImpl()
+    : block_(0), finished_(false), eofOffset_(EofLength), input_(0),
+    output_(0)
+  {}
+
+
+  Handle<Value> Init(const ArgumentsView &args) {
+    HandleScope scope;
+
+    level_ = Z_DEFAULT_COMPRESSION;
+    if (args.Length() > 0 && !args[0]->IsUndefined()) {
+      if (!args[0]->IsInt32() || args[0]->Int32Value() < -1 ||
+          args[0]->Int32Value() > 9) {
+        Local<Value> exception = Exception::TypeError(
+            String::New("level must be an integer"));
+        return ThrowException(exception);
+      }
+      level_ = args[0]->Int32Value();
+    }
+
+    threads_ = ParallelPool::DefaultThreads();
+    if (args.Length() > 1 &&
+        !GetIntegerOption(args[1], "threads", 1, MaxThreads, threads_)) {
+      return Undefined();
+    }
+    return Undefined();
+  }
+
+
+  int Write(char *data, int &dataLength, Blob &out) {
+    int ret = Drain(out, false);
+    COND_RETURN(Utils::IsError(ret), ret);
+
+    while (dataLength > 0) {
+      if (jobs_.length() >= Backlog()) {
+        // Caller is ahead of compression.
+        ret = Drain(out, true);
+        COND_RETURN(Utils::IsError(ret), ret);
+        if (jobs_.length() >= Backlog()) {
+          // Output is full.
+          break;
+        }
+      }
+
+      if (block_ == 0) {
+        block_ = new(std::nothrow) Job(level_);
+        COND_RETURN(block_ == 0, Z_MEM_ERROR);
+        COND_RETURN(!block_->input_.GrowBy(BlockInputLength), Z_MEM_ERROR);
+      }
+      size_t length = BlockInputLength - block_->input_.length();
+      if (length > static_cast<size_t>(dataLength)) {
+        length = dataLength;
+      }
+      memcpy(block_->input_.data() + block_->input_.length(), data, length);
+      block_->input_.IncreaseLengthBy(length);
+      data += length;
+      dataLength -= length;
+
+      if (block_->input_.length() == BlockInputLength) {
+        ret = Submit();
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+    }
+    return Drain(out, false);
+  }
+
+
+  // Output of already compressed blocks. Geometric growth of output takes
+  // care of the rest.
+  size_t WriteSizeHint(int dataLength) {
+    return jobs_.ReadyLength();
+  }
+
+
+  size_t FinishSizeHint() {
+    size_t length = jobs_.ReadyLength() + EofLength;
+    for (size_t i = 0; i < jobs_.length(); ++i) {
+      if (!ParallelPool::Done(jobs_[i])) {
+        length += Job::MaxBlockLength;
+      }
+    }
+    if (block_ != 0) {
+      length += Job::MaxBlockLength;
+    }
+    return length;
+  }
+
+
+  static bool GetFlushMode(Handle<Value> value, int &mode) {
+    return GzipImpl::GetFlushMode(value, mode);
+  }
+
+
+  // End current block and pass all the output. Blocks are independent, so
+  // both flush modes are the same.
+  int Flush(int mode, Blob &out) {
+    if (block_ != 0) {
+      int ret = Submit();
+      COND_RETURN(Utils::IsError(ret), ret);
+    }
+    return Drain(out, true);
+  }
+
+
+  int Finish(Blob &out) {
+    if (!finished_) {
+      if (block_ != 0) {
+        int ret = Submit();
+        COND_RETURN(Utils::IsError(ret), ret);
+      }
+      finished_ = true;
+      eofOffset_ = 0;
+    }
+
+    int ret = Drain(out, true);
+    COND_RETURN(Utils::IsError(ret), ret);
+    if (jobs_.length() != 0) {
+      return Z_OK;
+    }
+
+    size_t length = EofLength - eofOffset_;
+    if (length > out.avail()) {
+      length = out.avail();
+    }
+    memcpy(out.data() + out.length(), EofBlock + eofOffset_, length);
+    out.IncreaseLengthBy(length);
+    eofOffset_ += length;
+    if (eofOffset_ != EofLength) {
+      return Z_OK;
+    }
+    ret = EndMember(0, EofLength);
+    COND_RETURN(Utils::IsError(ret), ret);
+    return Z_STREAM_END;
+  }
+
+
+  // Blocks are reported as members.
+  void TakeBoundaries(Queue<MemberBoundary> &boundaries) {
+    MoveBoundaries(boundaries_, boundaries);
+  }
+
+
+  void TakeAccessPoints(Queue<AccessPoint*> &points) {}
+
+
+  void Destroy() {
+    jobs_.Clear();
+    delete block_;
+    block_ = 0;
+  }
+
+ private:
+  // Queue current block for compression.
+  int Submit() {
+    Job *job = block_;
+    block_ = 0;
+    if (job->input_.length() == 0) {
+      delete job;
+      return Z_OK;
+    }
+    COND_RETURN(!jobs_.Push(job, threads_), Z_MEM_ERROR);
+    return Z_OK;
+  }
+
+
+  // Pass output of compressed blocks in order, while output space is
+  // available. If wait is true, wait for blocks being compressed, so that
+  // output size hints account for them.
+  int Drain(Blob &out, bool wait) {
+    while (jobs_.FrontDone(wait)) {
+      Job *job = jobs_.Front();
+      COND_RETURN(Utils::IsError(job->status()), job->status());
+      if (!jobs_.CopyFront(out)) {
+        break;
+      }
+      int ret = EndMember(job->length_, job->output_.length());
+      COND_RETURN(Utils::IsError(ret), ret);
+      delete jobs_.Pop();
+    }
+    return Z_OK;
+  }
+
+
+  int EndMember(uint64_t input, uint64_t output) {
+    input_ += input;
+    output_ += output;
+    MemberBoundary boundary = { input_, output_ };
+    return boundaries_.Push(boundary) ? Z_OK : Z_MEM_ERROR;
+  }
+
+
+  // Maximum number of blocks queued for compression or waiting for output.
+  size_t Backlog() const {
+    return 2 * threads_;
+  }
+
+ private:
+  int level_;
+  int threads_;
+
+  // Blocks being compressed or waiting for output, in order.
+  ParallelQueue<Job> jobs_;
+
+  // Block being filled by input, or 0.
+  Job *block_;
+
+  // Whether input is finished, and part of end of file block already
+  // passed to output.
+  bool finished_;
+  size_t eofOffset_;
+
+  // Input and output of blocks passed so far, and their ends not yet taken.
+  uint64_t input_;
+  uint64_t output_;
+  Queue<MemberBoundary> boundaries_;
+};
+const char BgzfImpl::Name[] = "Bgzf";
+const Bytef BgzfImpl::EofBlock[] = {
+  0x1f, 0x8b, Z_DEFLATED, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+  0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+typedef ZipLib<BgzfImpl> Bgzf;
@@ -0,0 +1,327 @@
+/*
+ * Copyright 2010, Ivan Egorov (egorich.3.04@gmail.com).
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef NODE_COMPRESS_PARALLEL_H__
+#define NODE_COMPRESS_PARALLEL_H__
+
+// To have (std::nothrow).
+#include <new>
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+
+// Unit of work run by ParallelPool, e.g. compression of single block.
+class ParallelJob {
+  friend class ParallelPool;
+
+ public:
+  ParallelJob()
+    : done_(false), abandoned_(false)
+  {}
+
+  virtual ~ParallelJob() {}
+
+ protected:
+  // Executed in pool thread, or in submitting one, if pool fails.
+  virtual void Run() = 0;
+
+ private:
+  // Guarded by pool mutex.
+  bool done_;
+  bool abandoned_;
+};
+
+
+// Threads running jobs of parallel processors. Processor requests are
+// executed by eio worker, which must not wait for other eio requests, so
+// processors use threads of their own. Threads are shared by all
+// processors, started on demand and never stopped, as eio does.
+class ParallelPool {
+ public:
+  // Number of threads used if processor does not ask for specific number.
+  static int DefaultThreads() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? static_cast<int>(cpus) : 1;
+  }
+
+
+  // Queue job to be run by one of at least threads threads. Job is owned by
+  // caller, but must be either waited for, or abandoned. If job cannot be
+  // queued, it is run in calling thread.
+  static void Submit(ParallelJob *job, int threads) {
+    ParallelPool &pool = Instance();
+
+    pthread_mutex_lock(&pool.mutex_);
+    while (pool.threads_ < threads) {
+      pthread_t thread;
+      if (pthread_create(&thread, 0, ParallelPool::ThreadMain, &pool) != 0) {
+        break;
+      }
+      pthread_detach(thread);
+      ++pool.threads_;
+    }
+    bool queued = pool.threads_ > 0 && pool.jobs_.Push(job);
+    if (queued) {
+      pthread_cond_signal(&pool.queued_);
+    }
+    pthread_mutex_unlock(&pool.mutex_);
+
+    if (!queued) {
+      job->Run();
+      pthread_mutex_lock(&pool.mutex_);
+      job->done_ = true;
+      pthread_mutex_unlock(&pool.mutex_);
+    }
+  }
+
+
+  static bool Done(ParallelJob *job) {
+    ParallelPool &pool = Instance();
+
+    pthread_mutex_lock(&pool.mutex_);
+    bool done = job->done_;
+    pthread_mutex_unlock(&pool.mutex_);
+    return done;
+  }
+
+
+  static void Wait(ParallelJob *job) {
+    ParallelPool &pool = Instance();
+
+    pthread_mutex_lock(&pool.mutex_);
+    while (!job->done_) {
+      pthread_cond_wait(&pool.completed_, &pool.mutex_);
+    }
+    pthread_mutex_unlock(&pool.mutex_);
+  }
+
+
+  // Give up job result. Job is deleted as soon as it is not used by pool,
+  // and is not run at all if it has not been started yet.
+  static void Abandon(ParallelJob *job) {
+    ParallelPool &pool = Instance();
+
+    pthread_mutex_lock(&pool.mutex_);
+    bool done = job->done_;
+    job->abandoned_ = true;
+    pthread_mutex_unlock(&pool.mutex_);
+
+    if (done) {
+      delete job;
+    }
+  }
+
+ private:
+  ParallelPool()
+    : threads_(0)
+  {
+    pthread_mutex_init(&mutex_, 0);
+    pthread_cond_init(&queued_, 0);
+    pthread_cond_init(&completed_, 0);
+  }
+
+
+  // Pool is never destroyed, as its threads outlive static objects.
+  static ParallelPool& Instance() {
+    static ParallelPool *pool = new ParallelPool();
+    return *pool;
+  }
+
+
+  static void* ThreadMain(void *data) {
+    ParallelPool &pool = *reinterpret_cast<ParallelPool*>(data);
+
+    pthread_mutex_lock(&pool.mutex_);
+    while (true) {
+      while (pool.jobs_.length() == 0) {
+        pthread_cond_wait(&pool.queued_, &pool.mutex_);
+      }
+      ParallelJob *job = pool.jobs_.Pop();
+      if (!job->abandoned_) {
+        pthread_mutex_unlock(&pool.mutex_);
+        job->Run();
+        pthread_mutex_lock(&pool.mutex_);
+      }
+
+      job->done_ = true;
+      if (job->abandoned_) {
+        delete job;
+      } else {
+        pthread_cond_broadcast(&pool.completed_);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  pthread_mutex_t mutex_;
+  pthread_cond_t queued_;
+  pthread_cond_t completed_;
+
+  // Guarded by mutex_.
+  int threads_;
+  Queue<ParallelJob*> jobs_;
+};
+
+
+// Job producing output of parallel processor, e.g. compressed block.
+template <class B>
+class ParallelOutputJob : public ParallelJob {
+  template <class Job> friend class ParallelQueue;
+
+ public:
+  typedef B Blob;
+
+ public:
+  ParallelOutputJob()
+    : status_(0), passed_(0)
+  {}
+
+  // Processor status code.
+  int status() const {
+    return status_;
+  }
+
+ protected:
+  // Set by Run().
+  int status_;
+  Blob output_;
+
+ private:
+  // Output already passed to processor output.
+  size_t passed_;
+};
+
+
+// Jobs of single processor, whose output is passed to processor output in
+// order of submission.
+template <class Job>
+class ParallelQueue {
+ public:
+  typedef typename Job::Blob Blob;
+
+ public:
+  ~ParallelQueue() {
+    Clear();
+  }
+
+
+  size_t length() const {
+    return jobs_.length();
+  }
+
+
+  Job* Front() {
+    return jobs_.Front();
+  }
+
+
+  Job* operator[](size_t i) {
+    return jobs_[i];
+  }
+
+
+  // Take ownership over job and run it by one of at least threads threads.
+  bool Push(Job *job, int threads) {
+    if (!jobs_.Push(job)) {
+      delete job;
+      return false;
+    }
+    ParallelPool::Submit(job, threads);
+    return true;
+  }
+
+
+  Job* Pop() {
+    return jobs_.Pop();
+  }
+
+
+  // Abandon front job and put job to run by one of at least threads threads
+  // instead.
+  void ReplaceFront(Job *job, int threads) {
+    ParallelPool::Abandon(jobs_.Front());
+    jobs_.Front() = job;
+    ParallelPool::Submit(job, threads);
+  }
+
+
+  // Whether front job is done. Waits for it, if wait is true.
+  bool FrontDone(bool wait) {
+    if (jobs_.length() == 0) {
+      return false;
+    }
+    if (wait) {
+      ParallelPool::Wait(jobs_.Front());
+      return true;
+    }
+    return ParallelPool::Done(jobs_.Front());
+  }
+
+
+  // Pass output of done front job, as much as output space allows. Returns
+  // true if all of it is passed.
+  bool CopyFront(Blob &out) {
+    Job *job = jobs_.Front();
+    size_t length = job->output_.length() - job->passed_;
+    if (length > out.avail()) {
+      length = out.avail();
+    }
+    if (length != 0) {
+      memcpy(out.data() + out.length(), job->output_.data() + job->passed_,
+          length);
+      out.IncreaseLengthBy(length);
+      job->passed_ += length;
+    }
+    return job->passed_ == job->output_.length();
+  }
+
+
+  // Output of done jobs at the front, which is not passed yet.
+  size_t ReadyLength() {
+    size_t length = 0;
+    for (size_t i = 0; i < jobs_.length(); ++i) {
+      Job *job = jobs_[i];
+      if (!ParallelPool::Done(job)) {
+        break;
+      }
+      length += job->output_.length() - job->passed_;
+    }
+    return length;
+  }
+
+
+  void Clear() {
+    while (jobs_.length() != 0) {
+      ParallelPool::Abandon(jobs_.Pop());
+    }
+  }
+
+ private:
+  Queue<Job*> jobs_;
+};
+
+#endif
@@ -55,12 +55,12 @@ template <class T>
 class ScopedOutputBuffer {
  public:
   ScopedOutputBuffer() 
-    : data_(0), capacity_(0), length_(0)
+    : data_(0), capacity_(0), length_(0), borrowed_(false)
   {
   }
 
   ScopedOutputBuffer(size_t initialCapacity)
-    : data_(0), capacity_(0), length_(0)
+    : data_(0), capacity_(0), length_(0), borrowed_(false)
   {
     GrowBy(initialCapacity);
   }
@@ -78,6 +78,19 @@ class ScopedOutputBuffer {
   }
 
 
+  // Ensure that at least sz elements are available. Storage is grown at
+  // least twice, so that number of reallocations stays logarithmic
+  // in output size.
+  bool Reserve(size_t sz) {
+    if (sz <= avail()) {
+      return true;
+    }
+    size_t required = length_ + sz;
+    size_t doubled = capacity_ * 2;
+    return GrowTo(required > doubled ? required : doubled);
+  }
+
+
   void IncreaseLengthBy(size_t sz) {
     assert(sz >= 0);
     assert(length_ + sz <= capacity_);
@@ -91,9 +104,47 @@ class ScopedOutputBuffer {
 
 
   void Free() {
-    free(data_);
+    if (!borrowed_) {
+      free(data_);
+    }
+    data_ = 0;
+    capacity_ = 0;
+    borrowed_ = false;
+  }
+
+
+  // Use external memory as storage. Borrowed storage is never grown and
+  // never freed.
+  void Borrow(char *data, size_t size) {
+    Free();
+    data_ = reinterpret_cast<T*>(data);
+    capacity_ = size / sizeof(T);
+    length_ = 0;
+    borrowed_ = true;
+  }
+
+
+  // Give up ownership of data. Caller is responsible to free() it.
+  T* Release() {
+    assert(!borrowed_);
+    T *result = data_;
     data_ = 0;
     capacity_ = 0;
+    length_ = 0;
+    return result;
+  }
+
+
+  // Return unused capacity to allocator.
+  bool ShrinkToFit() {
+    if (length_ == capacity_) {
+      return true;
+    }
+    if (length_ == 0) {
+      Free();
+      return true;
+    }
+    return GrowTo(length_);
   }
 
 
@@ -115,12 +166,20 @@ class ScopedOutputBuffer {
   size_t avail() const {
     return capacity_ - length_;
   }
+
+
+  bool borrowed() const {
+    return borrowed_;
+  }
  
  private:
   bool GrowTo(size_t sz) {
     if (sz == 0) {
       return true;
     }
+    if (borrowed_) {
+      return false;
+    }
 
     T *tmp = (T*) realloc(data_, sz * sizeof(T));
     if (tmp == NULL) {
@@ -135,6 +194,7 @@ class ScopedOutputBuffer {
   T* data_;
   size_t capacity_;
   size_t length_;
+  bool borrowed_;
 
  private:
   ScopedOutputBuffer(ScopedOutputBuffer&);
@@ -163,6 +223,17 @@ class Queue {
     return false;
   }
 
+  E& Front() {
+    assert(length_ != 0);
+    return data_[initial_];
+  }
+
+  // i-th element from the front.
+  E& operator[](size_t i) {
+    assert(i < length_);
+    return data_[(initial_ + i) % capacity_];
+  }
+
   E Pop() {
     if (length_ == 0) {
       return E();
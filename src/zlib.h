@@ -27,6 +27,7 @@
 #include <new>
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include <node.h>
 #include <node_events.h>
@@ -56,6 +57,157 @@
 using namespace v8;
 using namespace node;
 
+
+// Arguments passed to processor Init(). Allows to skip leading arguments,
+// which are not processor parameters, and tells whether processor is run
+// by synchronous API, which has no handlers to report to.
+class ArgumentsView {
+ public:
+  explicit ArgumentsView(const Arguments &args, int offset = 0,
+      bool sync = false)
+    : args_(args), offset_(offset), sync_(sync)
+  {}
+
+  int Length() const {
+    int length = args_.Length() - offset_;
+    return length > 0 ? length : 0;
+  }
+
+  Local<Value> operator[](int i) const {
+    return args_[offset_ + i];
+  }
+
+  bool sync() const {
+    return sync_;
+  }
+
+ private:
+  const Arguments &args_;
+  int offset_;
+  bool sync_;
+};
+
+
+// Read integer field name of options object into value, unless field is
+// undefined. Throws TypeError and returns false, if field is not an integer
+// within [min, max].
+inline bool GetIntegerOption(Handle<Value> options, const char *name,
+    int min, int max, int &value) {
+  if (options.IsEmpty() || !options->IsObject()) {
+    return true;
+  }
+  Local<Value> field = options->ToObject()->Get(String::NewSymbol(name));
+  if (field->IsUndefined()) {
+    return true;
+  }
+  if (!field->IsInt32() || field->Int32Value() < min ||
+      field->Int32Value() > max) {
+    char message[128];
+    snprintf(message, sizeof(message),
+        "%s must be an integer in range [%d, %d]", name, min, max);
+    ThrowException(Exception::TypeError(String::New(message)));
+    return false;
+  }
+  value = field->Int32Value();
+  return true;
+}
+
+
+// End of member of multi-member input, e.g. gzip member, as offsets in
+// processor input and output.
+struct MemberBoundary {
+  uint64_t input;
+  uint64_t output;
+};
+
+
+// Move boundaries met by processor to request.
+inline void MoveBoundaries(Queue<MemberBoundary> &from,
+    Queue<MemberBoundary> &to) {
+  while (from.length() != 0) {
+    if (!to.Push(from.Pop())) {
+      DEBUG_P("Member boundary dropped");
+    }
+  }
+}
+
+
+// Position, decompression might be started from, e.g. deflate block start.
+// Input offset is in bits, as such positions might be not byte aligned.
+// Window keeps output preceding the point, which decompression after it
+// refers to, if any.
+struct AccessPoint {
+  uint64_t input;
+  uint64_t output;
+  ScopedOutputBuffer<char> window;
+};
+
+
+// Move access points met by processor to request, which takes ownership.
+inline void MoveAccessPoints(Queue<AccessPoint*> &from,
+    Queue<AccessPoint*> &to) {
+  while (from.length() != 0) {
+    AccessPoint *point = from.Pop();
+    if (!to.Push(point)) {
+      DEBUG_P("Access point dropped");
+      delete point;
+    }
+  }
+}
+
+
+// Delete access points, which are not taken.
+inline void ClearAccessPoints(Queue<AccessPoint*> &points) {
+  while (points.length() != 0) {
+    delete points.Pop();
+  }
+}
+
+
+// Read access point from JS object, as onaccesspoint() handler gets it.
+// window is left empty, if point has no window. Throws TypeError and
+// returns false, if offsets are not integers, or window is neither
+// undefined nor Buffer of at most maxWindow bytes.
+inline bool GetAccessPoint(Handle<Value> value, size_t maxWindow,
+    uint64_t &input, uint64_t &output, Local<Value> &window) {
+  // Offsets are passed as JS numbers, which are exact up to 2^53.
+  const double MaxOffset = 9007199254740992.0;
+
+  Local<Value> fields[3];
+  if (value->IsObject()) {
+    Local<Object> object = value->ToObject();
+    fields[0] = object->Get(String::NewSymbol("input"));
+    fields[1] = object->Get(String::NewSymbol("output"));
+    fields[2] = object->Get(String::NewSymbol("window"));
+  }
+  bool valid = !fields[0].IsEmpty();
+  for (int i = 0; valid && i < 2; ++i) {
+    double number = fields[i]->NumberValue();
+    valid = fields[i]->IsNumber() && number >= 0 && number <= MaxOffset &&
+      static_cast<double>(static_cast<uint64_t>(number)) == number;
+  }
+  if (valid && !fields[2]->IsUndefined()) {
+    valid = Buffer::HasInstance(fields[2]) &&
+      Buffer::Length(fields[2]->ToObject()) <= maxWindow;
+  }
+  if (!valid) {
+    char message[128];
+    snprintf(message, sizeof(message), "accessPoint must have input and "
+        "output offsets and window of at most %d bytes",
+        static_cast<int>(maxWindow));
+    ThrowException(Exception::TypeError(String::New(message)));
+    return false;
+  }
+
+  input = static_cast<uint64_t>(fields[0]->NumberValue());
+  output = static_cast<uint64_t>(fields[1]->NumberValue());
+  if (!fields[2]->IsUndefined()) {
+    window = fields[2];
+  }
+  return true;
+}
+
+
 template <class Processor>
 class ZipLib : ObjectWrap {
  private:
@@ -78,6 +230,7 @@ class ZipLib : ObjectWrap {
    public:
     enum Kind {
       RWrite,
+      RFlush,
       RClose,
       RDestroy
     };
@@ -87,26 +240,46 @@ class ZipLib : ObjectWrap {
       buffer_(Persistent<Value>::New(inputBuffer)),
       data_(Buffer::Data(inputBuffer->ToObject())),
       length_(Buffer::Length(inputBuffer->ToObject())),
-      callback_(Persistent<Function>::New(callback))
+      callback_(Persistent<Function>::New(callback)),
+      more_(false), autoFlushed_(false), next_(0)
     {}
     
     Request(ZipLib *self, Local<Function> callback)
       : kind_(RClose), self_(self),
-      callback_(Persistent<Function>::New(callback))
+      callback_(Persistent<Function>::New(callback)),
+      more_(false), autoFlushed_(false), next_(0)
+    {}
+
+    Request(ZipLib *self, int flushMode, Local<Function> callback)
+      : kind_(RFlush), self_(self), flushMode_(flushMode),
+      callback_(Persistent<Function>::New(callback)),
+      more_(false), autoFlushed_(false), next_(0)
     {}
 
     Request(ZipLib *self)
-      : kind_(RDestroy), self_(self)
+      : kind_(RDestroy), self_(self), more_(false), autoFlushed_(false),
+      next_(0)
     {}
 
+    // Make request produce output directly into caller-supplied Buffer.
+    void BorrowOutput(Local<Value> outputBuffer) {
+      outputBuffer_ = Persistent<Value>::New(outputBuffer);
+      Local<Object> object = outputBuffer->ToObject();
+      out_.Borrow(Buffer::Data(object), Buffer::Length(object));
+    }
+
    public:
     ~Request() {
       if (!buffer_.IsEmpty()) {
         buffer_.Dispose();
       }
+      if (!outputBuffer_.IsEmpty()) {
+        outputBuffer_.Dispose();
+      }
       if (!callback_.IsEmpty()) {
         callback_.Dispose();
       }
+      ClearAccessPoints(accessPoints_);
     }
 
     static Buffer *GetBuffer(Local<Value> buffer) {
@@ -115,14 +288,28 @@ class ZipLib : ObjectWrap {
 
    public:
     static Request* Write(Self *self, Local<Value> inputBuffer,
-        Local<Function> callback) {
+        Local<Value> outputBuffer, Local<Function> callback) {
       DEBUG_P("WRITE");
-      return new(std::nothrow) Request(self, inputBuffer, callback);
+      Request *result = new(std::nothrow) Request(self, inputBuffer, callback);
+      if (result != 0 && !outputBuffer.IsEmpty()) {
+        result->BorrowOutput(outputBuffer);
+      }
+      return result;
+    }
+
+    static Request* Flush(Self *self, int mode, Local<Function> callback) {
+      DEBUG_P("FLUSH");
+      return new(std::nothrow) Request(self, mode, callback);
     }
 
-    static Request* Close(Self *self, Local<Function> callback) {
+    static Request* Close(Self *self, Local<Value> outputBuffer,
+        Local<Function> callback) {
       DEBUG_P("CLOSE");
-      return new(std::nothrow) Request(self, callback);
+      Request *result = new(std::nothrow) Request(self, callback);
+      if (result != 0 && !outputBuffer.IsEmpty()) {
+        result->BorrowOutput(outputBuffer);
+      }
+      return result;
     }
 
     static Request* Destroy(Self *self) {
@@ -134,6 +321,18 @@ class ZipLib : ObjectWrap {
     void setStatus(int status) {
       status_ = status;
     }
+
+    void setMore(bool more) {
+      more_ = more;
+    }
+
+    void setAutoFlushed(bool autoFlushed) {
+      autoFlushed_ = autoFlushed;
+    }
+
+    void setNext(Request *next) {
+      next_ = next;
+    }
     
     char* buffer() const {
       return data_;
@@ -143,6 +342,10 @@ class ZipLib : ObjectWrap {
       return length_;
     }
 
+    int flushMode() const {
+      return flushMode_;
+    }
+
     Self *self() const {
       assert(this != 0);
       return self_;
@@ -152,6 +355,14 @@ class ZipLib : ObjectWrap {
       return out_;
     }
 
+    Queue<MemberBoundary> &boundaries() {
+      return boundaries_;
+    }
+
+    Queue<AccessPoint*> &accessPoints() {
+      return accessPoints_;
+    }
+
     Kind kind() const {
       return kind_;
     }
@@ -164,6 +375,26 @@ class ZipLib : ObjectWrap {
       return callback_;
     }
 
+    bool more() const {
+      return more_;
+    }
+
+    bool autoFlushed() const {
+      return autoFlushed_;
+    }
+
+    Request *next() const {
+      return next_;
+    }
+
+    // Transfer ownership over input Buffer reference to caller.
+    // Might be called from any thread as it does not touch V8 heap.
+    Persistent<Value> ReleaseInput() {
+      Persistent<Value> result = buffer_;
+      buffer_.Clear();
+      return result;
+    }
+
    private:
     Kind kind_;
 
@@ -176,11 +407,36 @@ class ZipLib : ObjectWrap {
     char *data_;
     int length_;
 
+    int flushMode_;
+
     Persistent<Function> callback_;
 
     // Output structures.
+    // Caller-supplied output Buffer is referenced in the same way as input.
+    Persistent<Value> outputBuffer_;
     Blob out_;
     int status_;
+
+    // Whether caller-supplied output Buffer was filled up before all the
+    // output was produced.
+    bool more_;
+
+    // Whether input up to this request was flushed by flush policy.
+    bool autoFlushed_;
+
+    // Next write request, which output was appended to output of this one.
+    Request *next_;
+
+    // Ends of members and access points met while request was processed.
+    Queue<MemberBoundary> boundaries_;
+    Queue<AccessPoint*> accessPoints_;
+  };
+
+  // Input left unprocessed because caller-supplied output Buffer is full.
+  struct PendingInput {
+    Persistent<Value> buffer;
+    char *data;
+    int length;
   };
 
  public:
@@ -193,10 +449,16 @@ class ZipLib : ObjectWrap {
     Self::constructor_->InstanceTemplate()->SetInternalFieldCount(1);
 
     NODE_SET_PROTOTYPE_METHOD(Self::constructor_, "write", Write);
+    NODE_SET_PROTOTYPE_METHOD(Self::constructor_, "flush", Flush);
+    NODE_SET_PROTOTYPE_METHOD(Self::constructor_, "setFlushPolicy",
+        SetFlushPolicy);
     NODE_SET_PROTOTYPE_METHOD(Self::constructor_, "close", Close);
     NODE_SET_PROTOTYPE_METHOD(Self::constructor_, "destroy", Destroy);
+    NODE_SET_PROTOTYPE_METHOD(Self::constructor_, "setBufferOutput",
+        SetBufferOutput);
 
     NODE_SET_METHOD(Self::constructor_, "createInstance_", Create);
+    NODE_SET_METHOD(Self::constructor_, "processSync_", ProcessSync);
 
     target->Set(String::NewSymbol(Processor::Name),
         Self::constructor_->GetFunction());
@@ -210,17 +472,45 @@ class ZipLib : ObjectWrap {
     }
     result->Wrap(args.This());
 
-    Transition t(result->state_, Self::Error);
-    Handle<Value> exception = result->processor_.Init(args);
-    if (!exception->IsUndefined()) {
-      return exception;
+    if (!result->Init(ArgumentsView(args))) {
+      return Undefined();
     }
-
-    t.alter(Self::Data);
     return args.This();
   }
 
 
+  // Process whole input at once in V8 thread, and return output Buffer.
+  // Cheaper than asynchronous requests for small inputs.
+  static Handle<Value> ProcessSync(const Arguments &args) {
+    HandleScope scope;
+
+    if (!Buffer::HasInstance(args[0])) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("Input must be of type Buffer"));
+      return ThrowException(exception);
+    }
+
+    Self self;
+    if (!self.Init(ArgumentsView(args, 1, true))) {
+      return Undefined();
+    }
+
+    Local<Object> input = args[0]->ToObject();
+    int length = Buffer::Length(input);
+
+    Blob out;
+    int ret = self.Write(Buffer::Data(input), length, out);
+    if (!Utils::IsError(ret)) {
+      bool more = false;
+      ret = self.Close(out, more);
+    }
+    if (Utils::IsError(ret)) {
+      return ThrowException(Utils::GetException(ret));
+    }
+    return scope.Close(GetOutputBuffer(out));
+  }
+
+
   static Handle<Value> Create(const Arguments &args) {
     HandleScope scope;
 
@@ -248,33 +538,110 @@ class ZipLib : ObjectWrap {
       return ThrowException(exception);
     }
 
+    int next = 1;
+    Local<Value> output;
+    if (args.Length() > next && Buffer::HasInstance(args[next])) {
+      output = args[next++];
+    }
+
     Local<Function> cb;
-    if (args.Length() > 1 && !args[1]->IsUndefined()) {
-      if (!args[1]->IsFunction()) {
+    if (args.Length() > next && !args[next]->IsUndefined()) {
+      if (!args[next]->IsFunction()) {
         return ThrowCallbackExpected();
       }
-      cb = Local<Function>::Cast(args[1]);
+      cb = Local<Function>::Cast(args[next]);
     }
 
     Self *self = ObjectWrap::Unwrap<Self>(args.This());
-    Request *request = Request::Write(self, args[0], cb);
+    Request *request = Request::Write(self, args[0], output, cb);
     return self->PushRequest(request);
   }
 
 
-  static Handle<Value> Close(const Arguments& args) {
+  static Handle<Value> Flush(const Arguments& args) {
     HandleScope scope;
 
+    int next = 0;
+    Local<Value> modeArg;
+    if (args.Length() > next && !args[next]->IsFunction()) {
+      modeArg = args[next++];
+    }
+
+    int mode;
+    if (!Processor::GetFlushMode(modeArg, mode)) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("Unknown flush mode"));
+      return ThrowException(exception);
+    }
+
     Local<Function> cb;
+    if (args.Length() > next && !args[next]->IsUndefined()) {
+      if (!args[next]->IsFunction()) {
+        return ThrowCallbackExpected();
+      }
+      cb = Local<Function>::Cast(args[next]);
+    }
+
+    Self *self = ObjectWrap::Unwrap<Self>(args.This());
+    Request *request = Request::Flush(self, mode, cb);
+    return self->PushRequest(request);
+  }
+
+
+  static Handle<Value> SetFlushPolicy(const Arguments& args) {
+    HandleScope scope;
+
+    double interval = 0;
     if (args.Length() > 0 && !args[0]->IsUndefined()) {
-      if (!args[0]->IsFunction()) {
+      interval = args[0]->NumberValue();
+    }
+    double length = 0;
+    if (args.Length() > 1 && !args[1]->IsUndefined()) {
+      length = args[1]->NumberValue();
+    }
+    if (!(interval >= 0) || !(length >= 0)) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("Flush interval and length must be non-negative"));
+      return ThrowException(exception);
+    }
+
+    int mode;
+    if (!Processor::GetFlushMode(
+          args.Length() > 2 ? args[2] : Local<Value>(), mode)) {
+      Local<Value> exception = Exception::TypeError(
+          String::New("Unknown flush mode"));
+      return ThrowException(exception);
+    }
+
+    Self *self = ObjectWrap::Unwrap<Self>(args.This());
+    pthread_mutex_lock(&self->requestsMutex_);
+    self->autoFlushMode_ = mode;
+    self->autoFlushInterval_ = interval / 1000;
+    self->autoFlushLength_ = static_cast<size_t>(length);
+    pthread_mutex_unlock(&self->requestsMutex_);
+    return Undefined();
+  }
+
+
+  static Handle<Value> Close(const Arguments& args) {
+    HandleScope scope;
+
+    int next = 0;
+    Local<Value> output;
+    if (args.Length() > next && Buffer::HasInstance(args[next])) {
+      output = args[next++];
+    }
+
+    Local<Function> cb;
+    if (args.Length() > next && !args[next]->IsUndefined()) {
+      if (!args[next]->IsFunction()) {
         return ThrowCallbackExpected();
       }
-      cb = Local<Function>::Cast(args[0]);
+      cb = Local<Function>::Cast(args[next]);
     }
 
     Self *self = ObjectWrap::Unwrap<Self>(args.This());
-    Request *request = Request::Close(self, cb);
+    Request *request = Request::Close(self, output, cb);
     return self->PushRequest(request);
   }
 
@@ -288,6 +655,15 @@ class ZipLib : ObjectWrap {
   }
 
 
+  static Handle<Value> SetBufferOutput(const Arguments& args) {
+    HandleScope scope;
+
+    Self *self = ObjectWrap::Unwrap<Self>(args.This());
+    self->bufferOutput_ = args.Length() == 0 || args[0]->BooleanValue();
+    return Undefined();
+  }
+
+
  private:
   // Attempt to push request.
   // Executed in V8 thread.
@@ -309,11 +685,6 @@ class ZipLib : ObjectWrap {
       return ThrowGentleOom();
     }
 
-    if (startProcessing) {
-      eio_custom(Self::DoProcess, EIO_PRI_DEFAULT,
-          Self::DoHandleCallbacks, request);
-    }
-
     DEBUG_P("ev_ref()");
     ev_ref(EV_DEFAULT_UC);
     DEBUG_P(" ev_ref() done");
@@ -321,9 +692,80 @@ class ZipLib : ObjectWrap {
     DEBUG_P("Ref()");
     Ref();
     DEBUG_P(" Ref() done");
+
+    if (startProcessing) {
+      if (ProcessInline(request)) {
+        // Callback is still called via callbackNotify_, i.e. not earlier
+        // than on next tick.
+        DEBUG_P("INLINE");
+        DoProcess();
+      } else {
+        eio_custom(Self::DoProcess, EIO_PRI_DEFAULT,
+            Self::DoHandleCallbacks, request);
+      }
+    }
     return Undefined();
   }
 
+
+  // Decide whether request is cheap enough to be processed in V8 thread,
+  // rather than handed over to thread pool. Estimated processing time is
+  // compared with budget, which grows as thread pool gets busy, as request
+  // would wait there anyway.
+  // Executed in V8 thread.
+  static bool ProcessInline(Request *request) {
+    switch (request->kind()) {
+      case Request::RWrite:
+        if (!Processor::InlineWrites ||
+            request->self()->FlushDue(request->length())) {
+          return false;
+        }
+        // Write into caller's Buffer might drain input and output held
+        // from earlier requests, whose cost is not known by request
+        // length. Requests are not processed, so pending_ is safe to read.
+        if (request->output().borrowed() ||
+            request->self()->pending_.length() != 0) {
+          return false;
+        }
+        break;
+
+      case Request::RFlush:
+      case Request::RClose:
+        // Cost depends on amount of data buffered by processor.
+        return false;
+
+      case Request::RDestroy:
+        return true;
+    }
+
+    int load = eio_nreqs();
+    int threads = eio_nthreads();
+    if (threads > 0) {
+      load /= threads;
+    }
+    if (load > InlineBudgetMaxScale - 1) {
+      load = InlineBudgetMaxScale - 1;
+    }
+    double budget = InlineBudget * (1 + load);
+
+    pthread_mutex_lock(&callbackMutex_);
+    double cost = costPerByte_ * request->length();
+    pthread_mutex_unlock(&callbackMutex_);
+    return cost <= budget;
+  }
+
+
+  // Update estimated processing time per byte of input.
+  // Executed in any thread.
+  static void UpdateCost(size_t length, double seconds) {
+    if (length < static_cast<size_t>(CostSampleMinLength)) {
+      return;
+    }
+    pthread_mutex_lock(&callbackMutex_);
+    costPerByte_ += (seconds / length - costPerByte_) / CostSampleWeight;
+    pthread_mutex_unlock(&callbackMutex_);
+  }
+
   // Process requests queue.
   // Executed in worker thread.
   static int DoProcess(eio_req *req) {
@@ -341,13 +783,21 @@ class ZipLib : ObjectWrap {
         DEBUG_P("POP: kind = %d", request->kind());
         switch (request->kind()) {
           case Request::RWrite:
+            this->ProcessWrite(request, request->output());
+            if (!Utils::IsError(request->status()) &&
+                !request->output().borrowed()) {
+              this->Coalesce(request);
+              this->AutoFlush(request);
+            }
+            break;
+
+          case Request::RFlush:
             request->setStatus(
-                this->Write(request->buffer(), request->length(),
-                  request->output()));
+                this->Flush(request->flushMode(), request->output()));
             break;
 
           case Request::RClose:
-            request->setStatus(this->Close(request->output()));
+            request->setStatus(this->Close(request));
             break;
 
           case Request::RDestroy:
@@ -355,23 +805,14 @@ class ZipLib : ObjectWrap {
             request->setStatus(Utils::StatusOk());
             break;
         }
-
-        pthread_mutex_lock(&callbackMutex_);
-        bool success = callbackQueue_.Push(request);
-        pthread_mutex_unlock(&callbackMutex_);
-        ev_async_send(EV_DEFAULT_UC_ &callbackNotify_);
-
-        // Unref counter triggered by request.
-        DEBUG_P("ev_unref() ...");
-        ev_unref(EV_DEFAULT_UC);
-        DEBUG_P("  ev_unref() done");
-        if (!success) {
-          // Normally we should unref self() after callback called in
-          // DoHandleCallbacks(), but as we failed to push request for 
-          // callback for this request, we should unref here.
-          DEBUG_P("request->self()->Unref()");
-          request->self()->Unref();
-          DEBUG_P("  request->self()->Unref() done");
+        this->processor_.TakeBoundaries(request->boundaries());
+        this->processor_.TakeAccessPoints(request->accessPoints());
+
+        // Request might be deleted as soon as it is completed.
+        Request *next;
+        for (; request != 0; request = next) {
+          next = request->next();
+          Complete(request);
         }
       }
 
@@ -383,6 +824,124 @@ class ZipLib : ObjectWrap {
 
   }
 
+  void ProcessWrite(Request *request, Blob &out) {
+    double start = ev_time();
+    if (unflushedLength_ == 0) {
+      unflushedSince_ = start;
+    }
+    unflushedLength_ += request->length();
+
+    // Input left from earlier requests is processed as well, and some of
+    // request input might be left, so cost is sampled by input consumed.
+    size_t pendingLength = pendingLength_;
+    request->setStatus(this->Write(request, out));
+    UpdateCost(pendingLength + request->length() - pendingLength_,
+        ev_time() - start);
+  }
+
+
+  // Whether flush policy requires flush after write of given length.
+  // Executed in the thread processing requests, or in V8 thread while
+  // no requests are processed.
+  bool FlushDue(int length) {
+    pthread_mutex_lock(&requestsMutex_);
+    size_t limit = autoFlushLength_;
+    double interval = autoFlushInterval_;
+    pthread_mutex_unlock(&requestsMutex_);
+
+    size_t unflushed = unflushedLength_ + length;
+    if (unflushed == 0) {
+      return false;
+    }
+    if (limit != 0 && unflushed >= limit) {
+      return true;
+    }
+    double since = unflushedLength_ != 0 ? unflushedSince_ : ev_time();
+    return interval != 0 && ev_time() - since >= interval;
+  }
+
+
+  // Flush output of write batch started by head request, if flush policy
+  // requires so. Output is appended to head request output, error is
+  // reported to the last request of batch.
+  void AutoFlush(Request *head) {
+    Request *last = head;
+    while (last->next() != 0) {
+      last = last->next();
+    }
+    if (Utils::IsError(last->status()) || !FlushDue(0)) {
+      return;
+    }
+
+    pthread_mutex_lock(&requestsMutex_);
+    int mode = autoFlushMode_;
+    pthread_mutex_unlock(&requestsMutex_);
+
+    DEBUG_P("AUTOFLUSH: unflushed = %d", static_cast<int>(unflushedLength_));
+    last->setStatus(this->Flush(mode, head->output()));
+    last->setAutoFlushed(!Utils::IsError(last->status()));
+  }
+
+
+  // Process queued writes following head request, so that their output is
+  // appended to output of head request. Small writes produce little or no
+  // output, and this saves on output allocations and Buffer objects.
+  void Coalesce(Request *head) {
+    Request *last = head;
+    int batchLength = head->length();
+
+    Request *request;
+    while (PopCoalescible(batchLength, request)) {
+      DEBUG_P("COALESCE: length = %d", request->length());
+      batchLength += request->length();
+      this->ProcessWrite(request, head->output());
+      last->setNext(request);
+      last = request;
+      if (Utils::IsError(request->status())) {
+        break;
+      }
+    }
+  }
+
+
+  bool PopCoalescible(int batchLength, Request*& request) {
+    request = 0;
+
+    pthread_mutex_lock(&requestsMutex_);
+    if (requestsQueue_.length() != 0) {
+      Request *next = requestsQueue_.Front();
+      if (next->kind() == Request::RWrite && !next->output().borrowed() &&
+          next->length() <= CoalesceMaxLength &&
+          batchLength + next->length() <= CoalesceMaxBatch) {
+        request = requestsQueue_.Pop();
+      }
+    }
+    pthread_mutex_unlock(&requestsMutex_);
+
+    return request != 0;
+  }
+
+
+  // Pass processed request to V8 thread for callback.
+  void Complete(Request *request) {
+    pthread_mutex_lock(&callbackMutex_);
+    bool success = callbackQueue_.Push(request);
+    pthread_mutex_unlock(&callbackMutex_);
+    ev_async_send(EV_DEFAULT_UC_ &callbackNotify_);
+
+    if (!success) {
+      // Normally we should unref event loop and self() after callback
+      // called in DoHandleCallbacks(), but as we failed to push request
+      // for callback for this request, we should unref here.
+      DEBUG_P("ev_unref() ...");
+      ev_unref(EV_DEFAULT_UC);
+      DEBUG_P("  ev_unref() done");
+      DEBUG_P("request->self()->Unref()");
+      request->self()->Unref();
+      DEBUG_P("  request->self()->Unref() done");
+    }
+  }
+
   // Handle callbacks.
   // Executed in V8 threads.
   static int DoHandleCallbacks(eio_req *req) {
@@ -391,8 +950,17 @@ class ZipLib : ObjectWrap {
       DEBUG_P("CALLBACK");
 
       Self *self = request->self();
-      self->DoCallback(request->callback(),
-          request->status(), request->output());
+      self->DoMemberCallbacks(request);
+      self->DoAccessPointCallbacks(request);
+      self->DoAutoFlushCallback(request);
+      self->DoCallback(request, self->bufferOutput_);
+      self->DisposeRetired();
+
+      // Unref counter triggered by request. Event loop is kept alive until
+      // callback is called, as request might be processed in V8 thread.
+      DEBUG_P("ev_unref() ...");
+      ev_unref(EV_DEFAULT_UC);
+      DEBUG_P("  ev_unref() done");
 
       DEBUG_P("self->Unref()");
       self->Unref();
@@ -406,17 +974,122 @@ class ZipLib : ObjectWrap {
     DoHandleCallbacks(0);
   }
 
-  static void DoCallback(Persistent<Function> cb, int r, Blob &out) {
+  // Pass ends of members to onmember(input, output) handler, if any. They
+  // are reported before output of request, which contains them.
+  void DoMemberCallbacks(Request *request) {
+    Queue<MemberBoundary> &boundaries = request->boundaries();
+    if (boundaries.length() == 0) {
+      return;
+    }
+
+    HandleScope scope;
+    Local<Value> handler = handle_->Get(String::NewSymbol("onmember"));
+    while (boundaries.length() != 0) {
+      MemberBoundary boundary = boundaries.Pop();
+      if (!handler->IsFunction()) {
+        continue;
+      }
+
+      Local<Value> argv[2];
+      argv[0] = Number::New(static_cast<double>(boundary.input));
+      argv[1] = Number::New(static_cast<double>(boundary.output));
+
+      TryCatch try_catch;
+
+      Local<Function>::Cast(handler)->Call(handle_, 2, argv);
+
+      if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+      }
+    }
+  }
+
+
+  // Call onautoflush() handler, if any, when flush policy flushed input up
+  // to request. It is called before callback of request, so that streams
+  // may skip flush of their own.
+  void DoAutoFlushCallback(Request *request) {
+    if (!request->autoFlushed()) {
+      return;
+    }
+
+    HandleScope scope;
+    Local<Value> handler = handle_->Get(String::NewSymbol("onautoflush"));
+    if (!handler->IsFunction()) {
+      return;
+    }
+
+    TryCatch try_catch;
+
+    Local<Function>::Cast(handler)->Call(handle_, 0, 0);
+
+    if (try_catch.HasCaught()) {
+      FatalException(try_catch);
+    }
+  }
+
+
+  // Pass access points to onaccesspoint(input, output, window) handler, if
+  // any, window being Buffer. They are reported before output of request,
+  // which contains them.
+  void DoAccessPointCallbacks(Request *request) {
+    Queue<AccessPoint*> &points = request->accessPoints();
+    if (points.length() == 0) {
+      return;
+    }
+
+    HandleScope scope;
+    Local<Value> handler = handle_->Get(String::NewSymbol("onaccesspoint"));
+    while (points.length() != 0) {
+      AccessPoint *point = points.Pop();
+      if (!handler->IsFunction()) {
+        delete point;
+        continue;
+      }
+
+      Local<Value> argv[3];
+      argv[0] = Number::New(static_cast<double>(point->input));
+      argv[1] = Number::New(static_cast<double>(point->output));
+      argv[2] = Local<Value>::New(Buffer::New(point->window.data(),
+            point->window.length())->handle_);
+      delete point;
+
+      TryCatch try_catch;
+
+      Local<Function>::Cast(handler)->Call(handle_, 3, argv);
+
+      if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+      }
+    }
+  }
+
+
+  static void DoCallback(Request *request, bool asBuffer) {
+    Persistent<Function> cb = request->callback();
     if (!cb.IsEmpty()) {
       HandleScope scope;
 
-      Local<Value> argv[2];
-      argv[0] = Utils::GetException(r);
-      argv[1] = Encode(out.data(), out.length(), BINARY);
+      Blob &out = request->output();
+
+      int argc = 2;
+      Local<Value> argv[3];
+      argv[0] = Utils::GetException(request->status());
+      if (out.borrowed()) {
+        // Output is already in caller's Buffer, so report its size and
+        // whether caller should ask for more.
+        argv[1] = Integer::New(out.length());
+        argv[2] = Local<Value>::New(Boolean::New(request->more()));
+        argc = 3;
+      } else if (asBuffer) {
+        argv[1] = GetOutputBuffer(out);
+      } else {
+        argv[1] = Encode(out.data(), out.length(), BINARY);
+      }
 
       TryCatch try_catch;
 
-      cb->Call(Context::GetCurrent()->Global(), 2, argv);
+      cb->Call(Context::GetCurrent()->Global(), argc, argv);
 
       if (try_catch.HasCaught()) {
         FatalException(try_catch);
@@ -425,6 +1098,28 @@ class ZipLib : ObjectWrap {
   }
 
  private:
+  // Wrap output into Buffer object, so that JS does not have to decode it
+  // from binary string. Buffer takes ownership over output data, so it is
+  // not copied.
+  static Local<Value> GetOutputBuffer(Blob &out) {
+    Buffer *buffer;
+    if (out.length() == 0 || !out.ShrinkToFit()) {
+      buffer = Buffer::New(reinterpret_cast<char*>(out.data()),
+          out.length());
+    } else {
+      size_t length = out.length();
+      char *data = reinterpret_cast<char*>(out.Release());
+      buffer = Buffer::New(data, length, Self::FreeOutputBuffer, 0);
+    }
+    return Local<Value>::New(buffer->handle_);
+  }
+
+
+  static void FreeOutputBuffer(char *data, void *hint) {
+    free(data);
+  }
+
+
   static bool ReentrantPop(Queue<Request*> &queue, pthread_mutex_t &mutex,
       Request*& request) {
     request = 0;
@@ -442,12 +1137,16 @@ class ZipLib : ObjectWrap {
  private:
 
   ZipLib()
-    : ObjectWrap(), state_(Self::Idle), processorActive_(false)
+    : ObjectWrap(), state_(Self::Idle), bufferOutput_(false),
+    autoFlushMode_(0), autoFlushLength_(0), autoFlushInterval_(0),
+    pendingLength_(0), unflushedLength_(0), unflushedSince_(0),
+    processorActive_(false)
   {
     pthread_mutex_init(&requestsMutex_, 0);
 
     // Lazy init. Safe to do it here as this always happen in JS-thread.
     if (!callbackInitialized_) {
+      callbackInitialized_ = true;
       pthread_mutex_init(&callbackMutex_, 0);
       ev_async_init(EV_DEFAULT_UC_ &callbackNotify_, Self::DoHandleCallbacks2);
       ev_async_start(EV_DEFAULT_UC_ &callbackNotify_);
@@ -458,18 +1157,89 @@ class ZipLib : ObjectWrap {
 
   ~ZipLib() {
     this->Destroy();
+    DisposeRetired();
+  }
+
+
+  // Returns false if exception is thrown.
+  bool Init(const ArgumentsView &args) {
+    Transition t(state_, Self::Error);
+
+    // ThrowException() returns undefined, so thrown exception is caught to
+    // tell failure.
+    TryCatch tryCatch;
+    Handle<Value> exception = this->processor_.Init(args);
+    if (tryCatch.HasCaught()) {
+      tryCatch.ReThrow();
+      return false;
+    }
+    if (!exception->IsUndefined()) {
+      ThrowException(exception);
+      return false;
+    }
+
+    t.alter(Self::Data);
+    return true;
+  }
+
+
+  int Write(Request *request, Blob &out) {
+    int ret = DrainPending(out);
+    COND_RETURN(Utils::IsError(ret), ret);
+    COND_RETURN(ret == Utils::StatusEndOfStream(), ret);
+
+    char *data = request->buffer();
+    int length = request->length();
+    if (pending_.length() == 0) {
+      ret = Write(data, length, out);
+      COND_RETURN(Utils::IsError(ret), ret);
+      COND_RETURN(ret == Utils::StatusEndOfStream(), ret);
+      data += request->length() - length;
+    }
+
+    if (length > 0) {
+      // Output Buffer is full, keep the rest of input until caller asks for
+      // more output.
+      PendingInput input;
+      input.buffer = request->ReleaseInput();
+      input.data = data;
+      input.length = length;
+      if (!pending_.Push(input)) {
+        Retire(input.buffer);
+        return Utils::StatusMemoryError();
+      }
+      pendingLength_ += length;
+    }
+
+    request->setMore(pending_.length() != 0 ||
+        (out.borrowed() && out.avail() == 0));
+    return Utils::StatusOk();
   }
 
 
-  int Write(char *data, int dataLength, Blob &out) {
+  int Write(char *data, int &dataLength, Blob &out) {
     COND_RETURN(state_ != Self::Data, Utils::StatusSequenceError());
 
     Transition t(state_, Self::Error);
 
     data += dataLength;
     int ret = Utils::StatusOk();
-    while (dataLength > 0) { 
-      COND_RETURN(!out.GrowBy(dataLength + 1), Utils::StatusMemoryError());
+
+    // Processor might hold output produced from earlier input, so it is
+    // called at least once if output space is limited.
+    bool drain = out.borrowed();
+    while (dataLength > 0 || drain) { 
+      drain = false;
+      if (out.borrowed()) {
+        if (out.avail() == 0) {
+          break;
+        }
+      } else {
+        // Processor hint is either exact upper bound of output, so space is
+        // allocated once, or an estimate, so space grows geometrically.
+        COND_RETURN(!out.Reserve(this->processor_.WriteSizeHint(dataLength)),
+            Utils::StatusMemoryError());
+      }
       
       ret = this->processor_.Write(data - dataLength, dataLength, out);
       COND_RETURN(Utils::IsError(ret), ret);
@@ -483,7 +1253,76 @@ class ZipLib : ObjectWrap {
   }
 
 
-  int Close(Blob &out) {
+  // Feed input left from previous requests to processor.
+  int DrainPending(Blob &out) {
+    while (pending_.length() != 0) {
+      PendingInput &input = pending_.Front();
+
+      int length = input.length;
+      int ret = Write(input.data, length, out);
+      COND_RETURN(Utils::IsError(ret), ret);
+      COND_RETURN(ret == Utils::StatusEndOfStream(), ret);
+
+      pendingLength_ -= input.length - length;
+      input.data += input.length - length;
+      input.length = length;
+      if (length > 0) {
+        break;
+      }
+      Retire(pending_.Pop().buffer);
+    }
+    return Utils::StatusOk();
+  }
+
+
+  int Flush(int mode, Blob &out) {
+    int ret = DrainPending(out);
+    COND_RETURN(Utils::IsError(ret), ret);
+    COND_RETURN(state_ == Self::Eos, Utils::StatusOk());
+    COND_RETURN(state_ != Self::Data, Utils::StatusSequenceError());
+
+    Transition t(state_, Self::Error);
+    unflushedLength_ = 0;
+
+    // Processor is called until it either leaves some output space unused,
+    // or makes no progress.
+    size_t length;
+    do {
+      length = out.length();
+      COND_RETURN(!out.Reserve(this->processor_.FinishSizeHint()),
+          Utils::StatusMemoryError());
+
+      ret = this->processor_.Flush(mode, out);
+      COND_RETURN(Utils::IsError(ret), ret);
+    } while (out.avail() == 0 && out.length() != length);
+
+    t.abort();
+    return Utils::StatusOk();
+  }
+
+
+  int Close(Request *request) {
+    COND_RETURN(state_ == Self::Idle || state_ == Self::Destroyed,
+        Utils::StatusOk());
+
+    Blob &out = request->output();
+    if (state_ == Self::Data) {
+      int ret = DrainPending(out);
+      COND_RETURN(Utils::IsError(ret), ret);
+      if (pending_.length() != 0) {
+        request->setMore(true);
+        return Utils::StatusOk();
+      }
+    }
+
+    bool more = false;
+    int ret = Close(out, more);
+    request->setMore(more);
+    return ret;
+  }
+
+
+  int Close(Blob &out, bool &more) {
     COND_RETURN(state_ == Self::Idle || state_ == Self::Destroyed,
         Utils::StatusOk());
 
@@ -491,7 +1330,13 @@ class ZipLib : ObjectWrap {
 
     int ret = Utils::StatusOk();
     if (state_ == Self::Data) {
-      ret = Finish(out);
+      ret = Finish(out, more);
+      if (more) {
+        // Caller-supplied output Buffer is full, stream is to be finished by
+        // subsequent close() call.
+        t.abort();
+        return ret;
+      }
     }
 
     t.abort();
@@ -505,15 +1350,26 @@ class ZipLib : ObjectWrap {
       this->processor_.Destroy();
     }
     state_ = Self::Destroyed;
-  }
 
+    while (pending_.length() != 0) {
+      Retire(pending_.Pop().buffer);
+    }
+    pendingLength_ = 0;
+  }
 
-  int Finish(Blob &out) {
-    const int Chunk = 128;
 
+  int Finish(Blob &out, bool &more) {
     int ret;
     do {
-      COND_RETURN(!out.GrowBy(Chunk), Utils::StatusMemoryError());
+      if (out.borrowed()) {
+        if (out.avail() == 0) {
+          more = true;
+          return Utils::StatusOk();
+        }
+      } else {
+        COND_RETURN(!out.Reserve(this->processor_.FinishSizeHint()),
+            Utils::StatusMemoryError());
+      }
       
       ret = this->processor_.Finish(out);
       COND_RETURN(Utils::IsError(ret), ret);
@@ -522,6 +1378,31 @@ class ZipLib : ObjectWrap {
   }
 
 
+  // Schedule Buffer reference to be disposed in V8 thread.
+  void Retire(Persistent<Value> buffer) {
+    if (buffer.IsEmpty()) {
+      return;
+    }
+    pthread_mutex_lock(&requestsMutex_);
+    bool pushed = retired_.Push(buffer);
+    pthread_mutex_unlock(&requestsMutex_);
+    if (!pushed) {
+      DEBUG_P("Buffer reference leaked");
+    }
+  }
+
+
+  // Dispose references scheduled by Retire().
+  // Executed in V8 thread.
+  void DisposeRetired() {
+    pthread_mutex_lock(&requestsMutex_);
+    while (retired_.length() != 0) {
+      retired_.Pop().Dispose();
+    }
+    pthread_mutex_unlock(&requestsMutex_);
+  }
+
+
  private:
   static Handle<Value> ThrowGentleOom() {
     V8::LowMemoryNotification();
@@ -541,9 +1422,48 @@ class ZipLib : ObjectWrap {
   Processor processor_;
   State state_;
 
+  // Whether output is passed to callbacks as Buffer rather than binary
+  // string. Accessed in V8 thread only.
+  bool bufferOutput_;
+
   pthread_mutex_t requestsMutex_;
   Queue<Request*> requestsQueue_;
 
+  // Automatic flush policy set by setFlushPolicy(): flush mode, input
+  // length and interval in seconds since first unflushed byte, after which
+  // writes are flushed. Zero limit is not checked. Guarded by requestsMutex_.
+  int autoFlushMode_;
+  size_t autoFlushLength_;
+  double autoFlushInterval_;
+
+  // Accessed from the thread processing requests only.
+  Queue<PendingInput> pending_;
+  size_t pendingLength_;
+  size_t unflushedLength_;
+  double unflushedSince_;
+
+  // Guarded by requestsMutex_.
+  Queue<Persistent<Value> > retired_;
+
+  // Budget for processing request in V8 thread, in seconds, and its maximum
+  // scale when thread pool is busy.
+  static const double InlineBudget;
+  static const int InlineBudgetMaxScale = 4;
+
+  // Limits of writes coalesced with preceding write: maximum length of
+  // each and maximum total length.
+  static const int CoalesceMaxLength = 16 * 1024;
+  static const int CoalesceMaxBatch = 256 * 1024;
+
+  // Requests used to estimate processing cost. Smaller inputs are dominated by
+  // constant overhead.
+  static const int CostSampleMinLength = 1024;
+  static const int CostSampleWeight = 8;
+
+  // Estimated processing time per input byte, in seconds. Guarded by
+  // callbackMutex_.
+  static double costPerByte_;
+
   static Persistent<FunctionTemplate> constructor_;
   static bool callbackInitialized_;
   static pthread_mutex_t callbackMutex_;
@@ -555,6 +1475,8 @@ class ZipLib : ObjectWrap {
 
 template <class T> Persistent<FunctionTemplate> ZipLib<T>::constructor_;
 template <class T> bool ZipLib<T>::callbackInitialized_ = false;
+template <class T> const double ZipLib<T>::InlineBudget = 50e-6;
+template <class T> double ZipLib<T>::costPerByte_ = 20e-9;
 template <class T> pthread_mutex_t ZipLib<T>::callbackMutex_;
 template <class T> ev_async ZipLib<T>::callbackNotify_;
 